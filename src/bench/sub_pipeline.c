@@ -0,0 +1,151 @@
+/* Subscribe rate of one connection against the pipeline depth.
+ *
+ * Every run opens a connection to the subscriber port, subscribes to count
+ * new channels sending depth SUBSCRIBE requests at a time before reading
+ * their confirmations, and reports the subscribes per second.
+ *
+ * Usage: sub_pipeline [host] [port] [count]
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "constant.h"
+
+#define BENCH_HOST      "127.0.0.1"
+#define BENCH_COUNT     100000
+#define BENCH_BUF_LEN   (1024*64)
+
+static const int depths[] = {1, 16, 256, 4096};
+
+static long long ustime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int bench_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+    int fd, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, buf, len)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read until n confirmations arrived. A confirmation of a channel without
+ * a newline in it is six lines, the last one being ":<count>". */
+static int read_acks(int fd, int n)
+{
+    static char buf[BENCH_BUF_LEN];
+    static int lines = 0;
+    ssize_t nread, i;
+
+    while (n) {
+        if ((nread = read(fd, buf, sizeof(buf))) <= 0) {
+            return -1;
+        }
+        for (i = 0; i < nread; i++) {
+            if (buf[i] == '\n' && ++lines == 6) {
+                lines = 0;
+                n--;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Subscribes per second over count channels with depth requests in flight */
+static double run(const char *host, const char *port, int count, int depth)
+{
+    char *req;
+    size_t len;
+    long long start;
+    int fd, i, j;
+
+    if ((fd = bench_connect(host, port)) == -1) {
+        fprintf(stderr, "failed to connect to %s:%s\n", host, port);
+        exit(1);
+    }
+    req = malloc((size_t) depth * 64);
+    start = ustime();
+    for (i = 0; i < count; i += depth) {
+        len = 0;
+        for (j = i; j < i + depth && j < count; j++) {
+            len += sprintf(req + len,
+                    "*2\r\n$9\r\nSUBSCRIBE\r\n$%d\r\nb.%d.%09d\r\n",
+                    (int) snprintf(NULL, 0, "b.%d.%09d", depth, j),
+                    depth, j);
+        }
+        if (write_all(fd, req, len) == -1 || read_acks(fd, j - i) == -1) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+    }
+    start = ustime() - start;
+    free(req);
+    close(fd);
+    return count * 1e6 / (start ? start : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = argc > 1 ? argv[1] : BENCH_HOST;
+    const char *port = argc > 2 ? argv[2] : NULL;
+    int count = argc > 3 ? atoi(argv[3]) : BENCH_COUNT;
+    char port_dflt[16];
+    size_t i;
+
+    if (!port) {
+        snprintf(port_dflt, sizeof(port_dflt), "%d", SUB_PORT_DLFT);
+        port = port_dflt;
+    }
+
+    printf("%d subscribes per connection\n", count);
+    printf("  depth  subscribes/s\n");
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        printf("  %5d  %12.0f\n", depths[i],
+                run(host, port, count, depths[i]));
+    }
+    return 0;
+}
@@ -15,7 +15,10 @@
 #include "event.h"
 #include "broker.h"
 #include "subcli.h"
-#include "trie_util.h"
+#include "subindex.h"
+#include "scan.h"
+#include "worker.h"
+#include "zmalloc.h"
 
 sharedStruct shared;
 
@@ -43,20 +46,31 @@ void server_config_init()
     server.pub_port = PUB_PORT_DLFT;
     server.sub_port = SUB_PORT_DLFT;
 
-    server.pub_srv_fd = -1;
-    server.sub_srv_fd = -1;
-    server.evloop = NULL;
-    server.pub_ev = NULL;
-    server.sub_ev = NULL;
+    server.io_threads = IO_THREADS_DFLT;
+    server.workers = NULL;
 
-    server.subcli_table = NULL;
-    server.subscibe_table = NULL;
-    server.sub_commands = NULL;
+    server.denied_cmd_flags = 0;
+
+    server.obuf_limits[SUBCLI_CLASS_NORMAL].hard_limit = OBUF_NORMAL_HARD_DFLT;
+    server.obuf_limits[SUBCLI_CLASS_NORMAL].soft_limit = OBUF_NORMAL_SOFT_DFLT;
+    server.obuf_limits[SUBCLI_CLASS_NORMAL].soft_seconds =
+        OBUF_NORMAL_SOFT_SECS_DFLT;
+    server.obuf_limits[SUBCLI_CLASS_PUBSUB].hard_limit = OBUF_PUBSUB_HARD_DFLT;
+    server.obuf_limits[SUBCLI_CLASS_PUBSUB].soft_limit = OBUF_PUBSUB_SOFT_DFLT;
+    server.obuf_limits[SUBCLI_CLASS_PUBSUB].soft_seconds =
+        OBUF_PUBSUB_SOFT_SECS_DFLT;
+    server.slow_policy = SLOW_POLICY_DFLT;
+    server.match_cache_size = MATCH_CACHE_SIZE_DFLT;
+    server.max_msg_len = MAX_MESSAGE_LEN_DFLT;
 
     server.pub_backlog = TCP_PUB_BACKLOG;
     server.sub_backlog = TCP_SUB_BACKLOG;
 
     server.sub_inc_counter = rand_int64(1 << 24);
+
+    server.stat_slow_disconnected = 0;
+    server.stat_slow_dropped = 0;
+    server.stat_slow_conflated = 0;
 }
 
 void server_init()
@@ -66,49 +80,31 @@ void server_init()
     }
 
     create_shared_struct();
-    server.subcli_table = ght_create(SIZE512);
-    server.subscibe_table = ght_create(SIZE512);
-    server.sub_commands = sub_commands_init();
-    server.sub_trie = trie_create();
-    init_conv(&server.dflt_to_alpha_conv);
-
-    server.evloop = event_base_new();
-    if (!server.evloop) {
-        srv_log(LOG_ERROR, "failed to initialize event loop");
+    scan_init();
+    srv_log(LOG_INFO, "protocol scanning uses %s", scan_impl_name());
+    if (sub_commands_init() != SUBCLI_OK) {
+        srv_log(LOG_ERROR, "failed to initialize the command table");
         exit(EXIT_FAILURE);
     }
-
-    int pub_fd = net_tcp_server(server.neterr, server.pub_port, server.pub_ip,
-            server.pub_backlog);
-    if (pub_fd == NET_ERR) {
-        srv_log(LOG_ERROR, "opening socket: %s", server.neterr);
+    /* every worker matches publishes against the subscriptions */
+    if (sub_index_init(server.io_threads, server.match_cache_size) !=
+            SUBINDEX_OK) {
+        srv_log(LOG_ERROR, "failed to initialize subscriptions");
         exit(EXIT_FAILURE);
     }
-    net_tcp_set_nonblock(NULL, pub_fd);
-    server.pub_srv_fd = pub_fd;
-
-    server.pub_ev = event_new(server.evloop, server.pub_srv_fd,
-            EV_READ|EV_PERSIST, accept_pub_handler, NULL);
-    event_add(server.pub_ev, NULL);
 
-    int sub_fd = net_tcp_server(server.neterr, server.sub_port, server.sub_ip,
-            server.sub_backlog);
-    if (sub_fd == NET_ERR) {
-        srv_log(LOG_ERROR, "opening socket: %s", server.neterr);
+    if (server.io_threads > 1) {
+        zmalloc_enable_thread_safeness();
+    }
+    if (workers_init() != BROKER_OK) {
+        srv_log(LOG_ERROR, "failed to initialize workers");
         exit(EXIT_FAILURE);
     }
-    net_tcp_set_nonblock(NULL, sub_fd);
-    server.sub_srv_fd = sub_fd;
-
-    server.sub_ev = event_new(server.evloop, server.sub_srv_fd,
-            EV_READ|EV_PERSIST, accept_sub_handler, NULL);
-    event_add(server.sub_ev, NULL);
-
 }
 
 static void server_evloop_start()
 {
-    event_base_dispatch(server.evloop);
+    workers_run();
 }
 
 void server_free()
@@ -120,9 +116,8 @@ void server_free()
     free(server.log_file);
     free(server.pub_ip);
     free(server.sub_ip);
-    if (server.pub_ev != NULL) event_free(server.pub_ev);
-    if (server.sub_ev != NULL) event_free(server.sub_ev);
-    if (server.evloop != NULL) event_base_free(server.evloop);
+    workers_free();
+    sub_index_free();
 }
 
 void usage()
@@ -178,7 +173,7 @@ int main(int argc, char *argv[])
 
     server_init();
 
-    srv_log(LOG_INFO, "starting main event loop");
+    srv_log(LOG_INFO, "starting %d event loop(s)", server.io_threads);
     server_evloop_start();
 
     server_free();
@@ -2,13 +2,21 @@
 #define __BROKER_H
 
 #include <event2/event.h>
-#include <datrie/trie.h>
-#include <iconv.h>
 
 #include "sds.h"
 #include "list.h"
-#include "ght_hash_table.h"
 #include "constant.h"
+#include "worker.h"
+
+struct sub_client;
+
+typedef struct obuf_limit {
+    /* bytes, 0 means no limit */
+    size_t hard_limit;
+    size_t soft_limit;
+    /* seconds the soft limit may be exceeded before the client is closed */
+    int soft_seconds;
+} obuf_limit;
 
 typedef struct broker {
     char *cfg_path;
@@ -20,22 +28,22 @@ typedef struct broker {
     char *sub_ip;
     int pub_port;
     int sub_port;
-    int pub_srv_fd;
-    int sub_srv_fd;
-    struct event_base *evloop;
-    struct event *pub_ev;
-    struct event *sub_ev;
-
-    /* mapping from subscibe-client id to the subscribe-client */
-    hashtable *subcli_table;
-    /* mapping from subscibe key to a list of clients who subscribed this key */
-    hashtable *subscibe_table;
-    /* mapping from command name key to sub_command struct */
-    hashtable *sub_commands;
-    /* a Trie structure recording the subscrib keys */
-    Trie *sub_trie;
-    /* used as default iconv to_code in trie structure */
-    iconv_t dflt_to_alpha_conv;
+
+    /* number of I/O threads, each one running its own worker */
+    int io_threads;
+    worker *workers;
+
+    /* subscribers may not run the commands with any of these flags */
+    int denied_cmd_flags;
+
+    /* output buffer limits of each subscribe client class */
+    obuf_limit obuf_limits[SUBCLI_CLASS_COUNT];
+    /* default slow consumer policy of subscriptions */
+    int slow_policy;
+    /* topics whose match result each I/O thread caches */
+    int match_cache_size;
+    /* max length of a published payload */
+    size_t max_msg_len;
 
     int pub_backlog;
     int sub_backlog;
@@ -46,6 +54,11 @@ typedef struct broker {
     /* auto increasing counter for sub clients */
     int sub_inc_counter;
 
+    /* slow consumer policy counters */
+    long long stat_slow_disconnected;
+    long long stat_slow_dropped;
+    long long stat_slow_conflated;
+
 } broker;
 
 typedef struct sharedStruct {
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "zmalloc.h"
+
+/* one cache line per slot, readers of different threads do not share one */
+typedef struct epoch_slot {
+    unsigned long long active;
+    char pad[64 - sizeof(unsigned long long)];
+} epoch_slot;
+
+typedef struct retired {
+    void *ptr;
+    epoch_free_fn *fn;
+    unsigned long long epoch;
+    struct retired *next;
+} retired;
+
+static struct {
+    /* starts at 1, an active value of 0 means the slot is quiescent */
+    unsigned long long global;
+    epoch_slot *slots;
+    int nslots;
+
+    pthread_mutex_t lock;
+    retired *retired;
+} ebr;
+
+int epoch_init(int nslots)
+{
+    ebr.global = 1;
+    ebr.nslots = nslots;
+    ebr.slots = (epoch_slot *) zcalloc(nslots * sizeof(epoch_slot));
+    if (!ebr.slots) {
+        return EPOCH_ERR;
+    }
+    ebr.retired = NULL;
+    pthread_mutex_init(&ebr.lock, NULL);
+    return EPOCH_OK;
+}
+
+/* Free everything still retired, no reader may be active any more */
+void epoch_finalize()
+{
+    retired *r, *next;
+
+    for (r = ebr.retired; r; r = next) {
+        next = r->next;
+        r->fn(r->ptr);
+        zfree(r);
+    }
+    ebr.retired = NULL;
+    zfree(ebr.slots);
+    ebr.slots = NULL;
+    pthread_mutex_destroy(&ebr.lock);
+}
+
+void epoch_enter(int slot)
+{
+    __atomic_store_n(&ebr.slots[slot].active,
+            __atomic_load_n(&ebr.global, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(int slot)
+{
+    __atomic_store_n(&ebr.slots[slot].active, 0, __ATOMIC_RELEASE);
+}
+
+/* Start a new epoch and return the previous one. Readers that see objects
+ * unpublished before the call are at most at the returned epoch. */
+unsigned long long epoch_advance()
+{
+    return __atomic_fetch_add(&ebr.global, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Whether every reader which was active at epoch has left */
+int epoch_passed(unsigned long long epoch)
+{
+    unsigned long long active;
+    int i;
+
+    for (i = 0; i < ebr.nslots; i++) {
+        active = __atomic_load_n(&ebr.slots[i].active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active <= epoch) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Free ptr with fn once the readers which may still see it are done. ptr
+ * must not be reachable by new readers any more. Without memory to defer
+ * it, the readers are waited for and ptr is freed right away, so the
+ * caller must not be a reader itself. */
+void epoch_retire(void *ptr, epoch_free_fn *fn)
+{
+    retired *r = (retired *) zmalloc(sizeof(retired));
+    unsigned long long epoch;
+
+    if (!r) {
+        epoch = epoch_advance();
+        while (!epoch_passed(epoch)) {
+            sched_yield();
+        }
+        fn(ptr);
+        return;
+    }
+    r->ptr = ptr;
+    r->fn = fn;
+    r->epoch = epoch_advance();
+    pthread_mutex_lock(&ebr.lock);
+    r->next = ebr.retired;
+    ebr.retired = r;
+    pthread_mutex_unlock(&ebr.lock);
+}
+
+/* Free the retired objects whose epoch has passed */
+void epoch_reclaim()
+{
+    retired *r, **prev, *done = NULL;
+
+    pthread_mutex_lock(&ebr.lock);
+    prev = &ebr.retired;
+    while ((r = *prev) != NULL) {
+        if (epoch_passed(r->epoch)) {
+            *prev = r->next;
+            r->next = done;
+            done = r;
+        } else {
+            prev = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&ebr.lock);
+
+    while ((r = done) != NULL) {
+        done = r->next;
+        r->fn(r->ptr);
+        zfree(r);
+    }
+}
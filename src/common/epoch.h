@@ -0,0 +1,26 @@
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+#define EPOCH_OK    0
+#define EPOCH_ERR   -1
+
+/* Epoch based reclamation.
+ *
+ * Readers announce the global epoch in their own slot for as long as they
+ * may hold pointers into shared data. A writer first unpublishes an object,
+ * then retires it: it is freed once no reader slot is still at the epoch it
+ * was retired in, or an older one. Readers never block.
+ * */
+
+typedef void epoch_free_fn(void *ptr);
+
+int epoch_init(int nslots);
+void epoch_finalize();
+void epoch_enter(int slot);
+void epoch_exit(int slot);
+unsigned long long epoch_advance();
+int epoch_passed(unsigned long long epoch);
+void epoch_retire(void *ptr, epoch_free_fn *fn);
+void epoch_reclaim();
+
+#endif
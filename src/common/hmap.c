@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmap.h"
+#include "zmalloc.h"
+
+#define HMAP_MIN_SLOTS  8
+
+/* The hash follows wyhash (final version 4, public domain): the input is
+ * read 8 or 16 bytes at a time and mixed by 64x64->128 bit multiplies, so
+ * short keys cost a couple of multiplies instead of a loop per byte. */
+
+static const uint64_t hmap_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t hmap_hash(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) key;
+    const uint64_t *s = hmap_secret;
+    uint64_t seed = mix(s[0], s[1]), a, b, see1, see2;
+    __uint128_t r;
+    size_t i = len;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+            b = (read4(p + len - 4) << 32) |
+                read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) |
+                p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            see1 = see2 = seed;
+            do {
+                seed = mix(read8(p) ^ s[1], read8(p + 8) ^ seed);
+                see1 = mix(read8(p + 16) ^ s[2], read8(p + 24) ^ see1);
+                see2 = mix(read8(p + 32) ^ s[3], read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read8(p) ^ s[1], read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    r = (__uint128_t) (a ^ s[1]) * (b ^ seed);
+    return mix((uint64_t) r ^ s[0] ^ len, (uint64_t) (r >> 64) ^ s[1]);
+}
+
+/* Distance of the entry at pos from its home slot */
+static inline size_t probe_dist(hmap *m, size_t pos)
+{
+    return (pos - (size_t) m->entries[pos].hash) & m->mask;
+}
+
+/* Place e, whose key is not in m, stealing the slots of entries closer to
+ * their home */
+static void hmap_put(hmap *m, hmap_entry e)
+{
+    size_t pos = (size_t) e.hash & m->mask, dist = 0, d;
+    hmap_entry tmp;
+
+    for (;;) {
+        if (!m->entries[pos].key) {
+            m->entries[pos] = e;
+            return;
+        }
+        if ((d = probe_dist(m, pos)) < dist) {
+            tmp = m->entries[pos];
+            m->entries[pos] = e;
+            e = tmp;
+            dist = d;
+        }
+        pos = (pos + 1) & m->mask;
+        dist++;
+    }
+}
+
+static hmap_entry *hmap_find(hmap *m, uint64_t hash, const void *key,
+        size_t len)
+{
+    size_t pos = (size_t) hash & m->mask, dist = 0;
+    hmap_entry *e;
+
+    for (;;) {
+        e = &m->entries[pos];
+        /* an entry closer to its home means the key would have been here */
+        if (!e->key || probe_dist(m, pos) < dist) {
+            return NULL;
+        }
+        if (e->hash == hash && e->len == len &&
+                memcmp(e->key, key, len) == 0) {
+            return e;
+        }
+        pos = (pos + 1) & m->mask;
+        dist++;
+    }
+}
+
+static int hmap_resize(hmap *m, size_t slots)
+{
+    hmap_entry *old = m->entries;
+    size_t i, old_slots = m->mask + 1;
+
+    if ((m->entries = zcalloc(slots * sizeof(hmap_entry))) == NULL) {
+        m->entries = old;
+        return HMAP_ERR;
+    }
+    m->mask = slots - 1;
+    for (i = 0; i < old_slots; i++) {
+        if (old[i].key) {
+            hmap_put(m, old[i]);
+        }
+    }
+    zfree(old);
+    return HMAP_OK;
+}
+
+/* A map sized for size entries */
+hmap *hmap_create(size_t size, int flags)
+{
+    hmap *m = (hmap *) zmalloc(sizeof(hmap));
+    size_t slots = HMAP_MIN_SLOTS;
+
+    if (!m) {
+        return NULL;
+    }
+    while (slots * 3 < size * 4) {
+        slots <<= 1;
+    }
+    if ((m->entries = zcalloc(slots * sizeof(hmap_entry))) == NULL) {
+        zfree(m);
+        return NULL;
+    }
+    m->size = 0;
+    m->mask = slots - 1;
+    m->flags = flags;
+    return m;
+}
+
+/* Copy of m with the same entries, the keys are copied unless they are
+ * borrowed, the values are shared */
+hmap *hmap_dup(hmap *m)
+{
+    hmap *d = (hmap *) zmalloc(sizeof(hmap));
+    size_t i;
+    char *copy;
+
+    if (!d) {
+        return NULL;
+    }
+    if ((d->entries = zmalloc((m->mask + 1) * sizeof(hmap_entry))) == NULL) {
+        zfree(d);
+        return NULL;
+    }
+    memcpy(d->entries, m->entries, (m->mask + 1) * sizeof(hmap_entry));
+    d->size = m->size;
+    d->mask = m->mask;
+    d->flags = m->flags;
+    for (i = 0; !(m->flags & HMAP_BORROW_KEYS) && i <= m->mask; i++) {
+        if (!m->entries[i].key) {
+            continue;
+        }
+        if ((copy = zmalloc(m->entries[i].len ? m->entries[i].len : 1))
+                == NULL) {
+            /* the keys left are the ones of m */
+            for (; i <= m->mask; i++) {
+                d->entries[i].key = NULL;
+            }
+            hmap_release(d);
+            return NULL;
+        }
+        memcpy(copy, m->entries[i].key, m->entries[i].len);
+        d->entries[i].key = copy;
+    }
+    return d;
+}
+
+void hmap_release(hmap *m)
+{
+    size_t i;
+
+    if (!(m->flags & HMAP_BORROW_KEYS)) {
+        for (i = 0; i <= m->mask; i++) {
+            zfree((char *) m->entries[i].key);
+        }
+    }
+    zfree(m->entries);
+    zfree(m);
+}
+
+size_t hmap_size(hmap *m)
+{
+    return m->size;
+}
+
+/* Map key to value, which must not be NULL. Returns HMAP_ERR if key is
+ * already there or on out of memory. */
+int hmap_insert(hmap *m, const void *key, size_t len, void *value)
+{
+    uint64_t hash = hmap_hash(key, len);
+    hmap_entry e;
+    char *copy;
+
+    if (hmap_find(m, hash, key, len)) {
+        return HMAP_ERR;
+    }
+    if ((m->size + 1) * 4 > (m->mask + 1) * 3 &&
+            hmap_resize(m, (m->mask + 1) * 2) != HMAP_OK) {
+        return HMAP_ERR;
+    }
+    if (m->flags & HMAP_BORROW_KEYS) {
+        e.key = (const char *) key;
+    } else {
+        /* a key may be empty, but never NULL */
+        if ((copy = zmalloc(len ? len : 1)) == NULL) {
+            return HMAP_ERR;
+        }
+        memcpy(copy, key, len);
+        e.key = copy;
+    }
+    e.hash = hash;
+    e.len = len;
+    e.value = value;
+    hmap_put(m, e);
+    m->size++;
+    return HMAP_OK;
+}
+
+/* Map key to value, whether it is there or not. Returns HMAP_ERR if key
+ * was not there and could not be added. */
+int hmap_replace(hmap *m, const void *key, size_t len, void *value)
+{
+    hmap_entry *e = hmap_find(m, hmap_hash(key, len), key, len);
+
+    if (!e) {
+        return hmap_insert(m, key, len, value);
+    }
+    e->value = value;
+    return HMAP_OK;
+}
+
+/* The value of key, or NULL */
+void *hmap_get(hmap *m, const void *key, size_t len)
+{
+    hmap_entry *e = hmap_find(m, hmap_hash(key, len), key, len);
+    return e ? e->value : NULL;
+}
+
+/* Same as hmap_get, for a caller which already has hmap_hash(key, len) */
+void *hmap_get_hashed(hmap *m, uint64_t hash, const void *key, size_t len)
+{
+    hmap_entry *e = hmap_find(m, hash, key, len);
+    return e ? e->value : NULL;
+}
+
+/* Remove key, returns its value or NULL if it is not there */
+void *hmap_remove(hmap *m, const void *key, size_t len)
+{
+    hmap_entry *e = hmap_find(m, hmap_hash(key, len), key, len);
+    size_t pos, next;
+    void *value;
+
+    if (!e) {
+        return NULL;
+    }
+    value = e->value;
+    if (!(m->flags & HMAP_BORROW_KEYS)) {
+        zfree((char *) e->key);
+    }
+    /* shift back the following entries until one at its home */
+    pos = e - m->entries;
+    for (;;) {
+        next = (pos + 1) & m->mask;
+        if (!m->entries[next].key || probe_dist(m, next) == 0) {
+            m->entries[pos].key = NULL;
+            break;
+        }
+        m->entries[pos] = m->entries[next];
+        pos = next;
+    }
+    m->size--;
+    return value;
+}
+
+/* Iterate the entries of m, in no particular order. The entry last
+ * returned may be removed before moving on, no other change is allowed
+ * while iterating. key and len may be NULL.
+ *
+ * The walk goes backwards from an empty slot: a removal only shifts back
+ * entries found between the removed one and the next empty slot, which
+ * have all been returned already. */
+void *hmap_first(hmap *m, hmap_iterator *iter, const void **key,
+        size_t *len)
+{
+    size_t i = 0;
+
+    /* there is always an empty slot */
+    while (m->entries[i].key) {
+        i++;
+    }
+    iter->pos = i;
+    iter->left = m->mask;
+    return hmap_next(m, iter, key, len);
+}
+
+void *hmap_next(hmap *m, hmap_iterator *iter, const void **key,
+        size_t *len)
+{
+    hmap_entry *e;
+
+    while (iter->left) {
+        iter->pos = (iter->pos - 1) & m->mask;
+        iter->left--;
+        e = &m->entries[iter->pos];
+        if (e->key) {
+            if (key) {
+                *key = e->key;
+            }
+            if (len) {
+                *len = e->len;
+            }
+            return e->value;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HMAP_TEST_MAIN
+#include <assert.h>
+
+#define TEST_KEYS   5000
+
+/* Distinct keys of 0 to 39 bytes, crossing every branch of the hash */
+static size_t test_key(int i, char *buf)
+{
+    size_t len;
+
+    if (i < 4) {
+        memcpy(buf, "abc", i);
+        return i;
+    }
+    len = sprintf(buf, "%d.", i);
+    while (len < (size_t) (i % 40)) {
+        buf[len] = 'a' + len % 26;
+        len++;
+    }
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    static int present[TEST_KEYS];
+    static char bufs[TEST_KEYS][48];
+    size_t lens[TEST_KEYS], len;
+    const void *key;
+    hmap_iterator iter;
+    unsigned int seed = 1;
+    hmap *m, *d;
+    void *v;
+    int i, j, n;
+    (void) argc;
+    (void) argv;
+
+    printf("hmap_test starts...\n");
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        lens[i] = test_key(i, bufs[i]);
+    }
+    m = hmap_create(0, 0);
+    for (j = 0; j < 200000; j++) {
+        i = rand_r(&seed) % TEST_KEYS;
+        if (present[i]) {
+            assert(hmap_get(m, bufs[i], lens[i]) == &present[i]);
+            assert(hmap_get_hashed(m, hmap_hash(bufs[i], lens[i]), bufs[i],
+                        lens[i]) == &present[i]);
+            assert(hmap_remove(m, bufs[i], lens[i]) == &present[i]);
+            assert(hmap_remove(m, bufs[i], lens[i]) == NULL);
+        } else {
+            assert(hmap_get(m, bufs[i], lens[i]) == NULL);
+            assert(hmap_insert(m, bufs[i], lens[i], &present[i]) == HMAP_OK);
+            assert(hmap_insert(m, bufs[i], lens[i], &present[i]) ==
+                    HMAP_ERR);
+        }
+        present[i] = !present[i];
+    }
+
+    /* a copy has the same entries and changes apart */
+    assert((d = hmap_dup(m)) != NULL && hmap_size(d) == hmap_size(m));
+    for (i = 0; i < TEST_KEYS; i++) {
+        assert(hmap_get(d, bufs[i], lens[i]) ==
+                (present[i] ? &present[i] : NULL));
+        if (present[i]) {
+            assert(hmap_remove(d, bufs[i], lens[i]) == &present[i]);
+            assert(hmap_get(m, bufs[i], lens[i]) == &present[i]);
+        }
+    }
+    assert(hmap_size(d) == 0);
+    hmap_release(d);
+
+    /* iterate, removing every entry on the way */
+    for (i = 0, n = 0; i < TEST_KEYS; i++) {
+        n += present[i];
+    }
+    assert(hmap_size(m) == (size_t) n);
+    for (v = hmap_first(m, &iter, &key, &len);
+         v;
+         v = hmap_next(m, &iter, &key, &len)) {
+        i = (int *) v - present;
+        assert(present[i] == 1 && len == lens[i]);
+        assert(memcmp(key, bufs[i], len) == 0);
+        present[i] = 2;
+        assert(hmap_remove(m, key, len) == v);
+        n--;
+    }
+    assert(n == 0 && hmap_size(m) == 0);
+
+    assert(hmap_replace(m, "k", 1, &present[0]) == HMAP_OK);
+    assert(hmap_get(m, "k", 1) == &present[0]);
+    assert(hmap_replace(m, "k", 1, &present[1]) == HMAP_OK);
+    assert(hmap_size(m) == 1);
+    assert(hmap_get(m, "k", 1) == &present[1]);
+    hmap_release(m);
+
+    m = hmap_create(4, HMAP_BORROW_KEYS);
+    assert(hmap_insert(m, bufs[100], lens[100], bufs[100]) == HMAP_OK);
+    assert(hmap_first(m, &iter, &key, &len) == bufs[100] &&
+            key == bufs[100]);
+    hmap_release(m);
+
+    printf("hmap_test ok\n");
+
+    return 0;
+}
+#endif
+
+#ifdef HMAP_BENCH_MAIN
+#include <time.h>
+
+#include "ght_hash_table.h"
+
+/* Compare hmap with ght_hash_table on the key shapes of the broker: client
+ * ids of 24 hex chars, channels of a few bytes, command names. */
+
+#define BENCH_KEYS      100000
+#define BENCH_ROUNDS    10
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *shape, char **keys, size_t *lens, int n)
+{
+    double t, ins[2] = {0}, hit[2] = {0}, miss[2] = {0}, del[2] = {0};
+    hashtable *g;
+    hmap *m;
+    int r, i;
+    long sum = 0;
+
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        g = ght_create(16);
+        ght_set_rehash(g, 1);
+        t = now();
+        for (i = 0; i < n; i++) {
+            ght_insert(g, keys[i], lens[i], keys[i]);
+        }
+        ins[0] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            sum += ght_get(g, lens[i], keys[i]) != NULL;
+        }
+        hit[0] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            sum += ght_get(g, lens[i] - 1, keys[i]) != NULL;
+        }
+        miss[0] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            ght_remove(g, lens[i], keys[i]);
+        }
+        del[0] += now() - t;
+        ght_finalize(g);
+
+        m = hmap_create(16, 0);
+        t = now();
+        for (i = 0; i < n; i++) {
+            hmap_insert(m, keys[i], lens[i], keys[i]);
+        }
+        ins[1] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            sum += hmap_get(m, keys[i], lens[i]) != NULL;
+        }
+        hit[1] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            sum += hmap_get(m, keys[i], lens[i] - 1) != NULL;
+        }
+        miss[1] += now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+            hmap_remove(m, keys[i], lens[i]);
+        }
+        del[1] += now() - t;
+        hmap_release(m);
+    }
+
+#define NS(x) ((x) * 1e9 / ((double) n * BENCH_ROUNDS))
+    printf("%-10s %7d keys   insert  hit  miss  remove (ns/op)\n", shape, n);
+    printf("  ght                   %6.1f %5.1f %5.1f %6.1f\n",
+            NS(ins[0]), NS(hit[0]), NS(miss[0]), NS(del[0]));
+    printf("  hmap                  %6.1f %5.1f %5.1f %6.1f\n",
+            NS(ins[1]), NS(hit[1]), NS(miss[1]), NS(del[1]));
+    /* keeps the lookups from being optimized out */
+    if (sum < 0) {
+        printf("%ld\n", sum);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *cmds[] = {
+        "ping", "subscribe", "unsubscribe", "psubscribe", "punsubscribe",
+        "esubscribe", "eunsubscribe", "subpolicy", "info"
+    };
+    int ncmds = sizeof(cmds) / sizeof(cmds[0]);
+    char **keys = malloc(BENCH_KEYS * sizeof(char *));
+    size_t *lens = malloc(BENCH_KEYS * sizeof(size_t));
+    int i;
+    (void) argc;
+    (void) argv;
+
+    for (i = 0; i < BENCH_KEYS; i++) {
+        keys[i] = malloc(32);
+        lens[i] = sprintf(keys[i], "%.8x%.6x%.4x%.6x", 0x5f000000 + i / 7,
+                0xffffff, 4242, i);
+    }
+    bench("client id", keys, lens, BENCH_KEYS);
+
+    for (i = 0; i < BENCH_KEYS; i++) {
+        lens[i] = sprintf(keys[i], "md.%c%c.%d", 'a' + i % 26,
+                'a' + i / 26 % 26, i);
+    }
+    bench("channel", keys, lens, BENCH_KEYS);
+
+    for (i = 0; i < ncmds; i++) {
+        lens[i] = sprintf(keys[i], "%s", cmds[i]);
+    }
+    bench("command", keys, lens, ncmds);
+
+    return 0;
+}
+#endif
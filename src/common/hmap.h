@@ -0,0 +1,62 @@
+#ifndef __HMAP_H
+#define __HMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HMAP_OK     0
+#define HMAP_ERR    -1
+
+/* hmap flags */
+#define HMAP_BORROW_KEYS    (1<<0)  /* keys are not copied, they must stay
+                                       valid while in the map, e.g. when
+                                       the key is held by the value */
+
+/* A hash map from byte strings to pointers.
+ *
+ * Entries are kept in one array probed linearly, Robin Hood style: an
+ * entry further from its home slot takes the place of one closer to its
+ * own, which keeps probe sequences short and lets a lookup stop early on a
+ * miss. Removal shifts the following entries back instead of leaving
+ * tombstones. Each entry keeps the 64 bit hash of its key, so probing
+ * mostly compares hashes. The map is kept at most 3/4 full.
+ * */
+
+typedef struct hmap_entry {
+    uint64_t hash;
+    /* NULL for an empty slot */
+    const char *key;
+    size_t len;
+    void *value;
+} hmap_entry;
+
+typedef struct hmap {
+    hmap_entry *entries;
+    size_t size;
+    /* number of slots - 1, the number of slots being a power of two */
+    size_t mask;
+    int flags;
+} hmap;
+
+typedef struct hmap_iterator {
+    size_t pos;
+    size_t left;
+} hmap_iterator;
+
+uint64_t hmap_hash(const void *key, size_t len);
+
+hmap *hmap_create(size_t size, int flags);
+hmap *hmap_dup(hmap *m);
+void hmap_release(hmap *m);
+size_t hmap_size(hmap *m);
+int hmap_insert(hmap *m, const void *key, size_t len, void *value);
+int hmap_replace(hmap *m, const void *key, size_t len, void *value);
+void *hmap_get(hmap *m, const void *key, size_t len);
+void *hmap_get_hashed(hmap *m, uint64_t hash, const void *key, size_t len);
+void *hmap_remove(hmap *m, const void *key, size_t len);
+void *hmap_first(hmap *m, hmap_iterator *iter, const void **key,
+        size_t *len);
+void *hmap_next(hmap *m, hmap_iterator *iter, const void **key,
+        size_t *len);
+
+#endif
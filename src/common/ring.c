@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "zmalloc.h"
+
+/* Create a ring holding up to cap elements, cap must be a power of 2 */
+ring *ring_create(size_t cap, size_t elem_size)
+{
+    ring *r;
+
+    if (cap == 0 || (cap & (cap - 1)) != 0) {
+        return NULL;
+    }
+    r = (ring *) zcalloc(sizeof(ring) + cap * elem_size);
+    if (!r) {
+        return NULL;
+    }
+    r->mask = cap - 1;
+    r->elem_size = elem_size;
+    return r;
+}
+
+void ring_free(ring *r)
+{
+    zfree(r);
+}
+
+/* Append a copy of elem, only called by the producer.
+ * Returns RING_ERR if the ring is full. */
+int ring_push(ring *r, const void *elem)
+{
+    size_t tail = r->tail;
+
+    if (tail - r->cached_head > r->mask) {
+        r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail - r->cached_head > r->mask) {
+            return RING_ERR;
+        }
+    }
+    memcpy(r->data + (tail & r->mask) * r->elem_size, elem, r->elem_size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return RING_OK;
+}
+
+/* Remove the oldest element into elem, only called by the consumer.
+ * Returns RING_ERR if the ring is empty. */
+int ring_pop(ring *r, void *elem)
+{
+    size_t head = r->head;
+
+    if (head == r->cached_tail) {
+        r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == r->cached_tail) {
+            return RING_ERR;
+        }
+    }
+    memcpy(elem, r->data + (head & r->mask) * r->elem_size, r->elem_size);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return RING_OK;
+}
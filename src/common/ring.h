@@ -0,0 +1,38 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include <stddef.h>
+
+#define RING_OK     0
+#define RING_ERR    -1
+
+#define RING_CACHE_LINE 64
+
+/* A bounded lock-free queue of fixed size elements between exactly one
+ * producer thread and one consumer thread.
+ *
+ * Each side owns one index and only reads the other one when its cached
+ * copy says the ring looks full (producer) or empty (consumer), so the two
+ * threads rarely touch the same cache line.
+ * */
+typedef struct ring {
+    /* consumer side */
+    size_t head;
+    size_t cached_tail;
+    char pad1[RING_CACHE_LINE - 2 * sizeof(size_t)];
+    /* producer side */
+    size_t tail;
+    size_t cached_head;
+    char pad2[RING_CACHE_LINE - 2 * sizeof(size_t)];
+
+    size_t mask;
+    size_t elem_size;
+    char data[];
+} ring;
+
+ring *ring_create(size_t cap, size_t elem_size);
+void ring_free(ring *r);
+int ring_push(ring *r, const void *elem);
+int ring_pop(ring *r, void *elem);
+
+#endif
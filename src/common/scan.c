@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef const char *crlf_proc(const char *p, size_t len);
+
+typedef struct scan_impl {
+    const char *name;
+    crlf_proc *crlf;
+} scan_impl;
+
+static const char *crlf_scalar(const char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i++) {
+        if (p[i] == '\r' && p[i + 1] == '\n') {
+            return p + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+/* The vector kernels test 64 bytes per iteration for a '\r', then 16 or 32
+ * bytes for a '\r' followed by a '\n'. A '\r' ending a block is carried
+ * over to the next one.
+ *
+ * The last bytes, fewer than a vector, are loaded as a whole vector when
+ * it does not cross a page, since reading past them can not fault then,
+ * and the bits past the end are masked off. The sanitizers are told to
+ * leave these loads alone. */
+
+#define PAGE_SAFE(p, w)     (((uintptr_t) (p) & 4095) <= 4096 - (w))
+
+#if defined(__clang__)
+#define SCAN_NO_SANITIZE    __attribute__((no_sanitize("address", "thread")))
+#else
+#define SCAN_NO_SANITIZE    __attribute__((no_sanitize_address, \
+            no_sanitize_thread))
+#endif
+
+__attribute__((target("sse2"))) SCAN_NO_SANITIZE
+static inline unsigned int eq_mask_sse2(const char *p, __m128i needle)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *) p), needle));
+}
+
+__attribute__((target("sse2"))) SCAN_NO_SANITIZE
+static const char *crlf_sse2(const char *p, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    unsigned int r, n, carry = 0, hits;
+
+    for (; i + 64 <= len; i += 64) {
+        if (_mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(
+                                (const __m128i *) (p + i)), cr),
+                        _mm_cmpeq_epi8(_mm_loadu_si128(
+                                (const __m128i *) (p + i + 16)), cr)),
+                    _mm_or_si128(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(
+                                (const __m128i *) (p + i + 32)), cr),
+                        _mm_cmpeq_epi8(_mm_loadu_si128(
+                                (const __m128i *) (p + i + 48)), cr))))) {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        if (carry && p[i] == '\n') {
+            return p + i - 1;
+        }
+        if ((r = eq_mask_sse2(p + i, cr)) == 0) {
+            carry = 0;
+            continue;
+        }
+        n = eq_mask_sse2(p + i, lf);
+        if ((hits = r & (n >> 1)) != 0) {
+            return p + i + __builtin_ctz(hits);
+        }
+        carry = r >> 15;
+    }
+    if (i == len) {
+        return NULL;
+    }
+    if (carry && p[i] == '\n') {
+        return p + i - 1;
+    }
+    if (!PAGE_SAFE(p + i, 16)) {
+        return crlf_scalar(p + i, len - i);
+    }
+    /* a '\r' ending the buffer finds its '\n' bit masked off */
+    r = eq_mask_sse2(p + i, cr) & ((1u << (len - i)) - 1);
+    n = eq_mask_sse2(p + i, lf) & ((1u << (len - i)) - 1);
+    hits = r & (n >> 1);
+    return hits ? p + i + __builtin_ctz(hits) : NULL;
+}
+
+__attribute__((target("avx2"))) SCAN_NO_SANITIZE
+static inline unsigned int eq_mask_avx2(const char *p, __m256i needle)
+{
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *) p), needle));
+}
+
+/* Lanes of p[0, 64) equal to needle */
+__attribute__((target("avx2"))) SCAN_NO_SANITIZE
+static inline __m256i any_eq_avx2(const char *p, __m256i needle)
+{
+    return _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p),
+                needle),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)),
+                needle));
+}
+
+__attribute__((target("avx2"))) SCAN_NO_SANITIZE
+static const char *crlf_avx2(const char *p, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    unsigned int r, n, carry = 0, hits;
+
+    for (; i + 128 <= len; i += 128) {
+        if (!_mm256_testz_si256(any_eq_avx2(p + i, cr), ones) ||
+                !_mm256_testz_si256(any_eq_avx2(p + i + 64, cr), ones)) {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        if (carry && p[i] == '\n') {
+            return p + i - 1;
+        }
+        if ((r = eq_mask_avx2(p + i, cr)) == 0) {
+            carry = 0;
+            continue;
+        }
+        n = eq_mask_avx2(p + i, lf);
+        if ((hits = r & (n >> 1)) != 0) {
+            return p + i + __builtin_ctz(hits);
+        }
+        carry = r >> 31;
+    }
+    if (i == len) {
+        return NULL;
+    }
+    if (carry && p[i] == '\n') {
+        return p + i - 1;
+    }
+    if (!PAGE_SAFE(p + i, 32)) {
+        return crlf_scalar(p + i, len - i);
+    }
+    /* a '\r' ending the buffer finds its '\n' bit masked off */
+    r = eq_mask_avx2(p + i, cr) & ((1u << (len - i)) - 1);
+    n = eq_mask_avx2(p + i, lf) & ((1u << (len - i)) - 1);
+    hits = r & (n >> 1);
+    return hits ? p + i + __builtin_ctz(hits) : NULL;
+}
+#endif
+
+static const scan_impl impls[] = {
+    {"scalar", crlf_scalar},
+#ifdef SCAN_X86
+    {"sse2", crlf_sse2},
+    {"avx2", crlf_avx2},
+#endif
+};
+
+#if defined(__x86_64__)
+/* SSE2 is part of x86-64 */
+static const scan_impl *impl = &impls[1];
+#else
+static const scan_impl *impl = &impls[0];
+#endif
+
+/* Pick the kernels for this CPU, called once before the threads start */
+void scan_init()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = &impls[2];
+    } else if (__builtin_cpu_supports("sse2")) {
+        impl = &impls[1];
+    }
+#endif
+}
+
+const char *scan_impl_name()
+{
+    return impl->name;
+}
+
+/* libc's memchr is vectorized already, and faster than kernels of ours */
+const char *scan_chr(const char *p, size_t len, char c)
+{
+    return memchr(p, c, len);
+}
+
+const char *scan_crlf(const char *p, size_t len)
+{
+    return impl->crlf(p, len);
+}
+
+#if defined(SCAN_TEST_MAIN) || defined(SCAN_BENCH_MAIN)
+#define NIMPLS  (sizeof(impls) / sizeof(impls[0]))
+
+/* The kernels usable on this CPU */
+static size_t usable_impls()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? NIMPLS : NIMPLS - 1;
+#else
+    return NIMPLS;
+#endif
+}
+#endif
+
+#ifdef SCAN_TEST_MAIN
+#include <assert.h>
+
+#define TEST_LEN    200
+
+int main(int argc, char *argv[])
+{
+    static char buf[TEST_LEN + 64];
+    static const char alphabet[] = {'a', '\r', '\n', '\0'};
+    unsigned int seed = 1;
+    size_t n = usable_impls(), i, k, off, len;
+    int round;
+    (void) argc;
+    (void) argv;
+
+    printf("scan_test starts...\n");
+
+    /* random buffers rich in delimiters, at every alignment and length,
+     * every kernel agreeing with the scalar one */
+    for (round = 0; round < 20000; round++) {
+        off = rand_r(&seed) % 32;
+        len = rand_r(&seed) % (TEST_LEN - 32);
+        for (i = 0; i < len; i++) {
+            buf[off + i] = rand_r(&seed) % 8 ?
+                alphabet[0] : alphabet[rand_r(&seed) % 4];
+        }
+        for (k = 1; k < n; k++) {
+            assert(impls[k].crlf(buf + off, len) ==
+                    crlf_scalar(buf + off, len));
+        }
+    }
+
+    /* a CRLF across every block boundary */
+    for (i = 0; i + 1 < TEST_LEN; i++) {
+        memset(buf, 'a', TEST_LEN);
+        buf[i] = '\r';
+        buf[i + 1] = '\n';
+        for (k = 0; k < n; k++) {
+            assert(impls[k].crlf(buf, TEST_LEN) == buf + i);
+            assert(impls[k].crlf(buf, i + 1) == NULL);
+        }
+    }
+
+    scan_init();
+    printf("scan_test ok, using %s\n", scan_impl_name());
+
+    return 0;
+}
+#endif
+
+#ifdef SCAN_BENCH_MAIN
+#include <time.h>
+
+#define BENCH_BYTES (1 << 25)
+#define BENCH_RUNS  5
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* GB/s searching a buffer of size bytes with the delimiter at its end, the
+ * best of BENCH_RUNS runs. A NULL s stands for libc's memchr. */
+static double bench(const char *buf, size_t size, const scan_impl *s)
+{
+    size_t i, rounds = BENCH_BYTES / size;
+    uintptr_t sum = 0;
+    double t, best = 0;
+    int run;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        t = now();
+        for (i = 0; i < rounds; i++) {
+            if (!s) {
+                sum += (uintptr_t) memchr(buf, '\r', size);
+            } else {
+                sum += (uintptr_t) s->crlf(buf, size);
+            }
+        }
+        t = rounds * size / (now() - t) / 1e9;
+        best = t > best ? t : best;
+    }
+    /* keeps the searches from being optimized out */
+    if (sum == 1) {
+        printf("%lu\n", (unsigned long) sum);
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t sizes[] = {16, 64, 256, 1024, 4096, 16384};
+    size_t n = usable_impls(), i, k;
+    char *buf = malloc(16384);
+    (void) argc;
+    (void) argv;
+
+    printf("GB/s to find the delimiter at the end of a message\n");
+    printf("%-12s", "size");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf("%8zu", sizes[i]);
+    }
+    printf("\n");
+    for (k = 0; k <= n; k++) {
+        printf("%-6s %-5s", k == n ? "libc" : impls[k].name,
+                k == n ? "chr" : "crlf");
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            memset(buf, 'a', sizes[i]);
+            buf[sizes[i] - 2] = '\r';
+            buf[sizes[i] - 1] = '\n';
+            printf("%8.2f", bench(buf, sizes[i],
+                        k == n ? NULL : &impls[k]));
+        }
+        printf("\n");
+    }
+    free(buf);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,22 @@
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <stddef.h>
+
+/* Delimiter search for the wire parsers.
+ *
+ * The buffers searched may hold any bytes, NUL included. A single byte is
+ * searched with memchr. The CRLF kernels compare 16 (SSE2) or 32 (AVX2)
+ * bytes at a time, the best one the CPU supports is picked by scan_init,
+ * before that the portable one is used.
+ * */
+
+void scan_init();
+const char *scan_impl_name();
+
+/* First c in p[0, len), or NULL */
+const char *scan_chr(const char *p, size_t len, char c);
+/* First "\r\n" in p[0, len), pointing at the '\r', or NULL */
+const char *scan_crlf(const char *p, size_t len);
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "subset.h"
+#include "zmalloc.h"
+
+#define SUBSET_INIT_CAP     4
+
+static uint32_t member_hash(void *member, uint32_t mask)
+{
+    return (uint32_t) (((uint64_t) (uintptr_t) member *
+                0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+/* Index slot holding member, or the empty slot ending its probe sequence */
+static uint32_t index_slot(subset *s, void *member)
+{
+    uint32_t i = member_hash(member, s->index_mask);
+
+    while (s->index[i] && s->members[s->index[i] - 1] != member) {
+        i = (i + 1) & s->index_mask;
+    }
+    return i;
+}
+
+/* Drop slot i from the index, moving back the entries of its probe
+ * sequence which follow it so that no tombstone is needed */
+static void index_delete(subset *s, uint32_t i)
+{
+    uint32_t j = i, home;
+
+    for (;;) {
+        s->index[i] = 0;
+        do {
+            j = (j + 1) & s->index_mask;
+            if (!s->index[j]) {
+                return;
+            }
+            home = member_hash(s->members[s->index[j] - 1], s->index_mask);
+            /* the entry at j stays if its home lies cyclically in (i, j] */
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        s->index[i] = s->index[j];
+        i = j;
+    }
+}
+
+/* (Re)build the index for the current capacity, at most half full */
+static int index_build(subset *s)
+{
+    uint32_t *index, size = 1, i;
+
+    while (size < 2 * s->cap) {
+        size <<= 1;
+    }
+    if ((index = zcalloc(size * sizeof(uint32_t))) == NULL) {
+        return SUBSET_ERR;
+    }
+    zfree(s->index);
+    s->index = index;
+    s->index_mask = size - 1;
+    for (i = 0; i < s->size; i++) {
+        s->index[index_slot(s, s->members[i])] = i + 1;
+    }
+    return SUBSET_OK;
+}
+
+/* Position of member, or -1 */
+static int64_t subset_find(subset *s, void *member)
+{
+    uint32_t i;
+
+    if (s->index) {
+        i = s->index[index_slot(s, member)];
+        return i ? (int64_t) i - 1 : -1;
+    }
+    for (i = 0; i < s->size; i++) {
+        if (s->members[i] == member) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+subset *subset_create()
+{
+    return (subset *) zcalloc(sizeof(subset));
+}
+
+/* Copy of s with the same members in the same order */
+subset *subset_dup(subset *s)
+{
+    subset *d = (subset *) zcalloc(sizeof(subset));
+
+    if (!d) {
+        return NULL;
+    }
+    if (s->size) {
+        if ((d->members = zmalloc(s->size * sizeof(void *))) == NULL) {
+            zfree(d);
+            return NULL;
+        }
+        memcpy(d->members, s->members, s->size * sizeof(void *));
+    }
+    d->size = d->cap = s->size;
+    if (d->size > SUBSET_SMALL && index_build(d) != SUBSET_OK) {
+        subset_release(d);
+        return NULL;
+    }
+    return d;
+}
+
+void subset_release(subset *s)
+{
+    zfree(s->members);
+    zfree(s->index);
+    zfree(s);
+}
+
+/* Add member to s, returns SUBSET_ERR if it is already there or on out of
+ * memory */
+int subset_add(subset *s, void *member)
+{
+    void **members;
+    uint32_t cap;
+
+    if (subset_find(s, member) != -1) {
+        return SUBSET_ERR;
+    }
+    if (s->size == s->cap) {
+        cap = s->cap ? s->cap * 2 : SUBSET_INIT_CAP;
+        if ((members = zrealloc(s->members, cap * sizeof(void *))) == NULL) {
+            return SUBSET_ERR;
+        }
+        s->members = members;
+        s->cap = cap;
+        if (s->index && index_build(s) != SUBSET_OK) {
+            return SUBSET_ERR;
+        }
+    }
+    s->members[s->size++] = member;
+    if (s->index) {
+        s->index[index_slot(s, member)] = s->size;
+    } else if (s->size > SUBSET_SMALL && index_build(s) != SUBSET_OK) {
+        s->size--;
+        return SUBSET_ERR;
+    }
+    return SUBSET_OK;
+}
+
+/* Remove member from s, the last member takes its place. Returns
+ * SUBSET_ERR if it is not there. */
+int subset_remove(subset *s, void *member)
+{
+    int64_t pos = subset_find(s, member);
+    void *last;
+
+    if (pos == -1) {
+        return SUBSET_ERR;
+    }
+    last = s->members[s->size - 1];
+    if (s->index) {
+        index_delete(s, index_slot(s, member));
+        if (last != member) {
+            s->index[index_slot(s, last)] = pos + 1;
+        }
+    }
+    s->members[pos] = last;
+    s->size--;
+    return SUBSET_OK;
+}
+
+int subset_has(subset *s, void *member)
+{
+    return subset_find(s, member) != -1;
+}
+
+#ifdef SUBSET_TEST_MAIN
+#include <assert.h>
+
+#define TEST_MEMBERS    1000
+
+int main(int argc, char *argv[])
+{
+    static char members[TEST_MEMBERS];
+    subset *s, *d;
+    uint32_t i, j;
+    int removed[TEST_MEMBERS] = {0};
+    unsigned int seed = 1;
+    (void) argc;
+    (void) argv;
+
+    printf("subset_test starts...\n");
+
+    s = subset_create();
+    for (i = 0; i < TEST_MEMBERS; i++) {
+        assert(subset_add(s, &members[i]) == SUBSET_OK);
+        assert(subset_add(s, &members[i]) == SUBSET_ERR);
+    }
+    assert(s->size == TEST_MEMBERS && s->index);
+
+    /* random removals and additions, checking every member each round */
+    for (j = 0; j < 20000; j++) {
+        i = rand_r(&seed) % TEST_MEMBERS;
+        if (removed[i]) {
+            assert(subset_add(s, &members[i]) == SUBSET_OK);
+        } else {
+            assert(subset_remove(s, &members[i]) == SUBSET_OK);
+            assert(subset_remove(s, &members[i]) == SUBSET_ERR);
+        }
+        removed[i] = !removed[i];
+        if (j % 1000 == 0) {
+            for (i = 0; i < TEST_MEMBERS; i++) {
+                assert(subset_has(s, &members[i]) == !removed[i]);
+            }
+        }
+    }
+
+    d = subset_dup(s);
+    assert(d->size == s->size);
+    for (i = 0; i < TEST_MEMBERS; i++) {
+        assert(subset_has(d, &members[i]) == !removed[i]);
+        if (!removed[i]) {
+            assert(subset_remove(s, &members[i]) == SUBSET_OK);
+        }
+    }
+    assert(s->size == 0);
+    subset_release(s);
+
+    /* a small set has no index */
+    s = subset_create();
+    for (i = 0; i < SUBSET_SMALL; i++) {
+        assert(subset_add(s, &members[i]) == SUBSET_OK);
+    }
+    assert(!s->index);
+    assert(subset_remove(s, &members[0]) == SUBSET_OK);
+    assert(s->members[0] == &members[SUBSET_SMALL - 1]);
+    assert(subset_has(s, &members[1]) && !subset_has(s, &members[0]));
+    subset_release(s);
+    subset_release(d);
+
+    printf("subset_test ok\n");
+
+    return 0;
+}
+#endif
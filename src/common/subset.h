@@ -0,0 +1,41 @@
+#ifndef __SUBSET_H
+#define __SUBSET_H
+
+#include <stdint.h>
+
+#define SUBSET_OK       0
+#define SUBSET_ERR      -1
+
+/* sets up to this size have no index, they are searched linearly */
+#define SUBSET_SMALL    16
+
+/* A set of subscriber pointers laid out for iteration.
+ *
+ * The members are kept in a dense array, so a fan-out walks contiguous
+ * memory: members[0] to members[size - 1], in no particular order. Sets
+ * larger than SUBSET_SMALL also keep an open addressing index from member
+ * to position, and a removed member is replaced by the last one, so that
+ * membership changes cost constant time.
+ * */
+
+typedef struct subset {
+    void **members;
+    uint32_t size;
+    uint32_t cap;
+    /* linear probing table of member position + 1, 0 for an empty slot,
+     * NULL while the set is small */
+    uint32_t *index;
+    uint32_t index_mask;
+    /* left to the user, 0 on creation, e.g. the trie_txn which owns the
+     * set when it is shared by several versions of an index */
+    uint64_t edit;
+} subset;
+
+subset *subset_create();
+subset *subset_dup(subset *s);
+void subset_release(subset *s);
+int subset_add(subset *s, void *member);
+int subset_remove(subset *s, void *member);
+int subset_has(subset *s, void *member);
+
+#endif
@@ -0,0 +1,1305 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "trie.h"
+#include "zmalloc.h"
+
+#define NODE_MAX_CHILDREN   256
+#define TXN_INIT_GARBAGE    16
+
+/* the last txn id handed out, 0 stands for no txn */
+static uint64_t txn_ids;
+
+/* Start a txn, with nothing to free yet */
+void trie_txn_begin(trie_txn *txn)
+{
+    txn->id = __atomic_add_fetch(&txn_ids, 1, __ATOMIC_RELAXED);
+    txn->garbage = NULL;
+    txn->ngarbage = 0;
+    txn->cap = 0;
+}
+
+/* Record ptr, replaced by a change made under txn, to be freed with fn by
+ * trie_txn_free_garbage(). ptr is leaked if there is no memory to record
+ * it, which leaves the tries valid. */
+void trie_txn_retire(trie_txn *txn, void *ptr, trie_free_fn *fn)
+{
+    trie_garbage *garbage;
+    size_t cap;
+
+    if (txn->ngarbage == txn->cap) {
+        cap = txn->cap ? txn->cap * 2 : TXN_INIT_GARBAGE;
+        if ((garbage = zrealloc(txn->garbage, cap * sizeof(trie_garbage)))
+                == NULL) {
+            return;
+        }
+        txn->garbage = garbage;
+        txn->cap = cap;
+    }
+    txn->garbage[txn->ngarbage].ptr = ptr;
+    txn->garbage[txn->ngarbage].fn = fn;
+    txn->ngarbage++;
+}
+
+/* Free what txn replaced, once no reader can see the old versions */
+void trie_txn_free_garbage(trie_txn *txn)
+{
+    size_t i;
+
+    for (i = 0; i < txn->ngarbage; i++) {
+        txn->garbage[i].fn(txn->garbage[i].ptr);
+    }
+    zfree(txn->garbage);
+    txn->garbage = NULL;
+    txn->ngarbage = 0;
+    txn->cap = 0;
+}
+
+/* Whether an object with the given edit id may be changed in place under
+ * txn: always without a txn, otherwise only if it was created under it */
+static int txn_owns(trie_txn *txn, uint64_t edit)
+{
+    return !txn || edit == txn->id;
+}
+
+static uint64_t txn_edit(trie_txn *txn)
+{
+    return txn ? txn->id : 0;
+}
+
+/* Free ptr, an object with the given edit id which left the trie. One
+ * readers may still see is only recorded in txn. */
+static void txn_drop(trie_txn *txn, void *ptr, uint64_t edit)
+{
+    if (txn_owns(txn, edit)) {
+        zfree(ptr);
+    } else {
+        trie_txn_retire(txn, ptr, zfree);
+    }
+}
+
+/* Offset of the children pointers from the start of a node */
+static size_t node_children_off(uint32_t label_len, uint16_t cap)
+{
+    size_t off = offsetof(trie_node, data) + label_len + cap;
+    return (off + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static unsigned char *node_keys(trie_node *n)
+{
+    return (unsigned char *) n->data + n->label_len;
+}
+
+static trie_node **node_children(trie_node *n)
+{
+    return (trie_node **) ((char *) n +
+            node_children_off(n->label_len, n->cap));
+}
+
+/* Allocate a node without children, its label is left to the caller */
+static trie_node *node_alloc(uint32_t label_len, uint16_t cap,
+        trie_txn *txn)
+{
+    trie_node *n = (trie_node *) zmalloc(node_children_off(label_len, cap) +
+            cap * sizeof(trie_node *));
+    if (!n) {
+        return NULL;
+    }
+    n->value = NULL;
+    n->edit = txn_edit(txn);
+    n->label_len = label_len;
+    n->nchildren = 0;
+    n->cap = cap;
+    n->terminal = 0;
+    return n;
+}
+
+/* Copy of n with the given label and room for cap children, label may
+ * point inside n */
+static trie_node *node_copy(trie_node *n, const char *label,
+        uint32_t label_len, uint16_t cap, trie_txn *txn)
+{
+    trie_node *nn = node_alloc(label_len, cap, txn);
+    if (!nn) {
+        return NULL;
+    }
+    memcpy(nn->data, label, label_len);
+    nn->value = n->value;
+    nn->terminal = n->terminal;
+    nn->nchildren = n->nchildren;
+    memcpy(node_keys(nn), node_keys(n), n->nchildren);
+    memcpy(node_children(nn), node_children(n),
+            n->nchildren * sizeof(trie_node *));
+    return nn;
+}
+
+/* Like node_copy(), but n is dropped. Returns NULL and leaves n untouched
+ * on OOM. */
+static trie_node *node_resize(trie_node *n, const char *label,
+        uint32_t label_len, uint16_t cap, trie_txn *txn)
+{
+    trie_node *nn = node_copy(n, label, label_len, cap, txn);
+    if (nn) {
+        txn_drop(txn, n, n->edit);
+    }
+    return nn;
+}
+
+/* The node in slot, replaced by a copy first if txn may not change it in
+ * place. The slot must be in a node txn may change. */
+static trie_node *node_writable(trie_node **slot, trie_txn *txn)
+{
+    trie_node *n = *slot;
+
+    if (txn_owns(txn, n->edit)) {
+        return n;
+    }
+    if ((n = node_resize(n, n->data, n->label_len, n->cap, txn)) == NULL) {
+        return NULL;
+    }
+    *slot = n;
+    return n;
+}
+
+static int node_find(trie_node *n, unsigned char c)
+{
+    unsigned char *keys = node_keys(n);
+    unsigned char *p = (unsigned char *) memchr(keys, c, n->nchildren);
+    return p ? p - keys : -1;
+}
+
+/* Append child to the writable node in slot, growing it if needed */
+static int node_add_child(trie_node **slot, trie_node *child, trie_txn *txn)
+{
+    trie_node *n = *slot;
+    uint16_t cap;
+
+    if (n->nchildren == n->cap) {
+        cap = n->cap ? n->cap * 2 : 2;
+        if (cap > NODE_MAX_CHILDREN) {
+            cap = NODE_MAX_CHILDREN;
+        }
+        if ((n = node_resize(n, n->data, n->label_len, cap, txn)) == NULL) {
+            return TRIE_ERR;
+        }
+        *slot = n;
+    }
+    node_keys(n)[n->nchildren] = (unsigned char) child->data[0];
+    node_children(n)[n->nchildren] = child;
+    n->nchildren++;
+    return TRIE_OK;
+}
+
+static void node_remove_child(trie_node *n, int idx)
+{
+    int last = n->nchildren - 1;
+
+    node_keys(n)[idx] = node_keys(n)[last];
+    node_children(n)[idx] = node_children(n)[last];
+    n->nchildren--;
+}
+
+/* Merge the writable non terminal node in slot with its only child. The
+ * trie is still valid if this fails, only less compact. */
+static void node_merge(trie_node **slot, trie_txn *txn)
+{
+    trie_node *n = *slot, *child = node_children(n)[0], *nn;
+
+    nn = node_alloc(n->label_len + child->label_len, child->cap, txn);
+    if (!nn) {
+        return;
+    }
+    memcpy(nn->data, n->data, n->label_len);
+    memcpy(nn->data + n->label_len, child->data, child->label_len);
+    nn->value = child->value;
+    nn->terminal = child->terminal;
+    nn->nchildren = child->nchildren;
+    memcpy(node_keys(nn), node_keys(child), child->nchildren);
+    memcpy(node_children(nn), node_children(child),
+            child->nchildren * sizeof(trie_node *));
+    txn_drop(txn, child, child->edit);
+    txn_drop(txn, n, n->edit);
+    *slot = nn;
+}
+
+static void node_release(trie_node *n, trie_txn *txn)
+{
+    int i;
+
+    for (i = 0; i < n->nchildren; i++) {
+        node_release(node_children(n)[i], txn);
+    }
+    txn_drop(txn, n, n->edit);
+}
+
+void trie_init(trie *t)
+{
+    t->root = NULL;
+    t->size = 0;
+}
+
+/* Drop every key of t, the values are left to the caller */
+void trie_clear(trie *t, trie_txn *txn)
+{
+    if (t->root) {
+        node_release(t->root, txn);
+    }
+    trie_init(t);
+}
+
+size_t trie_size(trie *t)
+{
+    return t->size;
+}
+
+/* Store key with value, replacing the value if key is already stored */
+int trie_insert(trie *t, const char *key, size_t len, void *value,
+        trie_txn *txn)
+{
+    trie_node **slot = &t->root, **child_slot;
+    trie_node *n, *child, *mid, *rest, *leaf;
+    size_t pos = 0, common, max;
+    int i;
+
+    if (!t->root && (t->root = node_alloc(0, 0, txn)) == NULL) {
+        return TRIE_ERR;
+    }
+    if ((n = node_writable(slot, txn)) == NULL) {
+        return TRIE_ERR;
+    }
+    for (;;) {
+        if (pos == len) {
+            if (!n->terminal) {
+                n->terminal = 1;
+                t->size++;
+            }
+            n->value = value;
+            return TRIE_OK;
+        }
+
+        i = node_find(n, (unsigned char) key[pos]);
+        if (i == -1) {
+            if ((leaf = node_alloc(len - pos, 0, txn)) == NULL) {
+                return TRIE_ERR;
+            }
+            memcpy(leaf->data, key + pos, len - pos);
+            leaf->terminal = 1;
+            leaf->value = value;
+            if (node_add_child(slot, leaf, txn) != TRIE_OK) {
+                zfree(leaf);
+                return TRIE_ERR;
+            }
+            t->size++;
+            return TRIE_OK;
+        }
+
+        child_slot = &node_children(n)[i];
+        child = *child_slot;
+        max = child->label_len < len - pos ? child->label_len : len - pos;
+        for (common = 1; common < max; common++) {
+            if (child->data[common] != key[pos + common]) {
+                break;
+            }
+        }
+
+        if (common < child->label_len) {
+            /* split the edge to child where key leaves it */
+            if ((mid = node_alloc(common, 2, txn)) == NULL) {
+                return TRIE_ERR;
+            }
+            memcpy(mid->data, child->data, common);
+            rest = node_resize(child, child->data + common,
+                    child->label_len - common, child->cap, txn);
+            if (!rest) {
+                zfree(mid);
+                return TRIE_ERR;
+            }
+            node_add_child(&mid, rest, txn);
+            *child_slot = child = mid;
+        } else if ((child = node_writable(child_slot, txn)) == NULL) {
+            return TRIE_ERR;
+        }
+        pos += common;
+        slot = child_slot;
+        n = child;
+    }
+}
+
+/* Remove key, pruning the nodes left without purpose.
+ * Returns TRIE_ERR if key is not stored. */
+int trie_delete(trie *t, const char *key, size_t len, trie_txn *txn)
+{
+    trie_node **parent_slot = NULL, **slot = &t->root;
+    trie_node *n, *parent;
+    size_t pos = 0;
+    int i, idx = -1;
+
+    /* nothing is copied for a missing key */
+    if (trie_find(t, key, len, NULL) != TRIE_OK ||
+            (n = node_writable(slot, txn)) == NULL) {
+        return TRIE_ERR;
+    }
+    while (pos < len) {
+        i = node_find(n, (unsigned char) key[pos]);
+        parent_slot = slot;
+        slot = &node_children(n)[i];
+        idx = i;
+        if ((n = node_writable(slot, txn)) == NULL) {
+            return TRIE_ERR;
+        }
+        pos += n->label_len;
+    }
+    n->terminal = 0;
+    n->value = NULL;
+    t->size--;
+
+    if (n == t->root) {
+        return TRIE_OK;
+    }
+    if (n->nchildren == 0) {
+        parent = *parent_slot;
+        node_remove_child(parent, idx);
+        txn_drop(txn, n, n->edit);
+        if (parent != t->root && !parent->terminal &&
+                parent->nchildren == 1) {
+            node_merge(parent_slot, txn);
+        }
+    } else if (n->nchildren == 1) {
+        node_merge(slot, txn);
+    }
+    return TRIE_OK;
+}
+
+/* Look key up, its value is stored in value if it is not NULL.
+ * Returns TRIE_ERR if key is not stored. */
+int trie_find(trie *t, const char *key, size_t len, void **value)
+{
+    trie_node *n = t->root, *child;
+    size_t pos = 0;
+    int i;
+
+    if (!n) {
+        return TRIE_ERR;
+    }
+    while (pos < len) {
+        if ((i = node_find(n, (unsigned char) key[pos])) == -1) {
+            return TRIE_ERR;
+        }
+        child = node_children(n)[i];
+        if (child->label_len > len - pos ||
+                memcmp(child->data, key + pos, child->label_len) != 0) {
+            return TRIE_ERR;
+        }
+        n = child;
+        pos += child->label_len;
+    }
+    if (!n->terminal) {
+        return TRIE_ERR;
+    }
+    if (value) {
+        *value = n->value;
+    }
+    return TRIE_OK;
+}
+
+/* Call proc for every stored key which is a prefix of s, from the shortest
+ * to the longest. Returns the number of calls. */
+int trie_prefixes(trie *t, const char *s, size_t len, trie_prefix_proc *proc,
+        void *privdata)
+{
+    trie_node *n = t->root, *child;
+    size_t pos = 0;
+    int i, count = 0;
+
+    while (n) {
+        if (n->terminal) {
+            proc(s, pos, n->value, privdata);
+            count++;
+        }
+        if (pos == len) {
+            break;
+        }
+        if ((i = node_find(n, (unsigned char) s[pos])) == -1) {
+            break;
+        }
+        child = node_children(n)[i];
+        /* the first byte of the label matched through the keys */
+        if (child->label_len > len - pos ||
+                memcmp(child->data + 1, s + pos + 1,
+                    child->label_len - 1) != 0) {
+            break;
+        }
+        n = child;
+        pos += child->label_len;
+    }
+    return count;
+}
+
+typedef struct walk_buf {
+    char *data;
+    size_t cap;
+} walk_buf;
+
+static int node_walk(trie_node *n, walk_buf *buf, size_t len,
+        trie_walk_proc *proc, void *privdata)
+{
+    char *data;
+    size_t cap;
+    int i;
+
+    if (len + n->label_len > buf->cap) {
+        cap = buf->cap ? buf->cap : 64;
+        while (cap < len + n->label_len) {
+            cap *= 2;
+        }
+        if ((data = (char *) zrealloc(buf->data, cap)) == NULL) {
+            return TRIE_ERR;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    if (n->label_len) {
+        memcpy(buf->data + len, n->data, n->label_len);
+        len += n->label_len;
+    }
+
+    if (n->terminal) {
+        proc(buf->data, len, n->value, privdata);
+    }
+    for (i = 0; i < n->nchildren; i++) {
+        if (node_walk(node_children(n)[i], buf, len, proc, privdata)
+                != TRIE_OK) {
+            return TRIE_ERR;
+        }
+    }
+    return TRIE_OK;
+}
+
+/* Call proc for every stored key, in no particular order. proc must not
+ * change the trie. Returns TRIE_ERR if it ran out of memory midway. */
+int trie_walk(trie *t, trie_walk_proc *proc, void *privdata)
+{
+    walk_buf buf = {NULL, 0};
+    int ret;
+
+    if (!t->root) {
+        return TRIE_OK;
+    }
+    ret = node_walk(t->root, &buf, 0, proc, privdata);
+    zfree(buf.data);
+    return ret;
+}
+
+/* Length of the segment starting at s */
+static size_t seg_len(const char *s, size_t len)
+{
+    const char *sep = (const char *) memchr(s, SEG_TRIE_SEP, len);
+    return sep ? (size_t) (sep - s) : len;
+}
+
+static int seg_is(const char *s, size_t len, char wildcard)
+{
+    return len == 1 && s[0] == wildcard;
+}
+
+/* Whether pattern matches topic, both split into segments */
+int seg_match(const char *pattern, size_t plen, const char *topic,
+        size_t tlen)
+{
+    size_t ppos = 0, tpos = 0, pl, tl;
+
+    for (;;) {
+        pl = seg_len(pattern + ppos, plen - ppos);
+        tl = seg_len(topic + tpos, tlen - tpos);
+        if (seg_is(pattern + ppos, pl, SEG_TRIE_REST) && ppos + pl == plen) {
+            return 1;
+        }
+        if (!seg_is(pattern + ppos, pl, SEG_TRIE_ONE) && (pl != tl ||
+                    memcmp(pattern + ppos, topic + tpos, pl) != 0)) {
+            return 0;
+        }
+        ppos += pl;
+        tpos += tl;
+        if (ppos == plen || tpos == tlen) {
+            return ppos == plen && tpos == tlen;
+        }
+        /* skip the separators */
+        ppos++;
+        tpos++;
+    }
+}
+
+/* Whether pattern is not empty and has no ">" segment but the last one */
+static int seg_valid(const char *pattern, size_t len)
+{
+    size_t pos = 0, l;
+
+    if (len == 0) {
+        return 0;
+    }
+    for (;;) {
+        l = seg_len(pattern + pos, len - pos);
+        if (pos + l == len) {
+            return 1;
+        }
+        if (seg_is(pattern + pos, l, SEG_TRIE_REST)) {
+            return 0;
+        }
+        pos += l + 1;
+    }
+}
+
+static seg_node *seg_node_create(trie_txn *txn)
+{
+    seg_node *n = (seg_node *) zcalloc(sizeof(seg_node));
+    if (n) {
+        n->edit = txn_edit(txn);
+    }
+    return n;
+}
+
+static int seg_node_empty(seg_node *n)
+{
+    return !n->term && !n->rest && !n->one && trie_size(&n->literals) == 0;
+}
+
+static void seg_node_release(seg_node *n, trie_txn *txn);
+
+static void release_literal(const char *key, size_t len, void *child,
+        void *privdata)
+{
+    (void) key;
+    (void) len;
+    seg_node_release((seg_node *) child, (trie_txn *) privdata);
+}
+
+static void seg_node_release(seg_node *n, trie_txn *txn)
+{
+    trie_walk(&n->literals, release_literal, txn);
+    trie_clear(&n->literals, txn);
+    if (n->one) {
+        seg_node_release(n->one, txn);
+    }
+    if (n->term) {
+        txn_drop(txn, n->term, n->term->edit);
+    }
+    if (n->rest) {
+        txn_drop(txn, n->rest, n->rest->edit);
+    }
+    txn_drop(txn, n, n->edit);
+}
+
+/* The child of n through the segment s, NULL if there is none */
+static seg_node *seg_node_child(seg_node *n, const char *s, size_t len)
+{
+    void *child;
+
+    if (seg_is(s, len, SEG_TRIE_ONE)) {
+        return n->one;
+    }
+    if (trie_find(&n->literals, s, len, &child) != TRIE_OK) {
+        return NULL;
+    }
+    return (seg_node *) child;
+}
+
+/* The child of the writable node n through the segment s, replaced by a
+ * copy first if txn may not change it in place, and created if missing
+ * when create is set */
+static seg_node *seg_node_writable_child(seg_node *n, const char *s,
+        size_t len, int create, trie_txn *txn)
+{
+    seg_node *child = seg_node_child(n, s, len), *copy;
+
+    if (child && txn_owns(txn, child->edit)) {
+        return child;
+    }
+    if (child) {
+        if ((copy = (seg_node *) zmalloc(sizeof(seg_node))) == NULL) {
+            return NULL;
+        }
+        *copy = *child;
+        copy->edit = txn_edit(txn);
+    } else if (!create || (copy = seg_node_create(txn)) == NULL) {
+        return NULL;
+    }
+    if (seg_is(s, len, SEG_TRIE_ONE)) {
+        n->one = copy;
+    } else if (trie_insert(&n->literals, s, len, copy, txn) != TRIE_OK) {
+        zfree(copy);
+        return NULL;
+    }
+    if (child) {
+        txn_drop(txn, child, child->edit);
+    }
+    return copy;
+}
+
+/* The root of t, created or replaced by a copy if txn may not change it */
+static seg_node *seg_root_writable(seg_trie *t, trie_txn *txn)
+{
+    seg_node *root = t->root;
+
+    if (root && txn_owns(txn, root->edit)) {
+        return root;
+    }
+    if (root) {
+        if ((t->root = (seg_node *) zmalloc(sizeof(seg_node))) == NULL) {
+            t->root = root;
+            return NULL;
+        }
+        *t->root = *root;
+        t->root->edit = txn_edit(txn);
+        txn_drop(txn, root, root->edit);
+    } else if ((t->root = seg_node_create(txn)) == NULL) {
+        return NULL;
+    }
+    return t->root;
+}
+
+/* Drop the child of the writable node n through the segment s if it is
+ * left empty */
+static void seg_node_prune(seg_node *n, const char *s, size_t len,
+        seg_node *child, trie_txn *txn)
+{
+    if (!seg_node_empty(child)) {
+        return;
+    }
+    if (seg_is(s, len, SEG_TRIE_ONE)) {
+        n->one = NULL;
+    } else {
+        if (trie_delete(&n->literals, s, len, txn) != TRIE_OK) {
+            return;
+        }
+        if (trie_size(&n->literals) == 0) {
+            trie_clear(&n->literals, txn);
+        }
+    }
+    seg_node_release(child, txn);
+}
+
+/* The term slot of pattern, NULL if pattern is invalid or a node leading
+ * to it is missing */
+static seg_term **seg_term_slot(seg_trie *t, const char *pattern,
+        size_t len)
+{
+    seg_node *n = t->root;
+    size_t pos = 0, l;
+
+    if (len == 0 || !n) {
+        return NULL;
+    }
+    for (;;) {
+        l = seg_len(pattern + pos, len - pos);
+        if (seg_is(pattern + pos, l, SEG_TRIE_REST)) {
+            return pos + l == len ? &n->rest : NULL;
+        }
+        if ((n = seg_node_child(n, pattern + pos, l)) == NULL) {
+            return NULL;
+        }
+        if (pos + l == len) {
+            return &n->term;
+        }
+        pos += l + 1;
+    }
+}
+
+void seg_trie_init(seg_trie *t)
+{
+    t->root = NULL;
+    t->size = 0;
+}
+
+/* Drop every pattern of t, the values are left to the caller */
+void seg_trie_clear(seg_trie *t, trie_txn *txn)
+{
+    if (t->root) {
+        seg_node_release(t->root, txn);
+    }
+    seg_trie_init(t);
+}
+
+size_t seg_trie_size(seg_trie *t)
+{
+    return t->size;
+}
+
+/* Store pattern with value, replacing the value if pattern is already
+ * stored. Returns TRIE_ERR if pattern is empty or has a ">" segment which
+ * is not the last one. */
+int seg_trie_insert(seg_trie *t, const char *pattern, size_t len,
+        void *value, trie_txn *txn)
+{
+    seg_term **slot, *term;
+    seg_node *n;
+    size_t pos = 0, l;
+
+    if (!seg_valid(pattern, len) || (n = seg_root_writable(t, txn)) == NULL) {
+        return TRIE_ERR;
+    }
+    for (;;) {
+        l = seg_len(pattern + pos, len - pos);
+        if (seg_is(pattern + pos, l, SEG_TRIE_REST)) {
+            slot = &n->rest;
+            break;
+        }
+        if ((n = seg_node_writable_child(n, pattern + pos, l, 1, txn))
+                == NULL) {
+            return TRIE_ERR;
+        }
+        if (pos + l == len) {
+            slot = &n->term;
+            break;
+        }
+        pos += l + 1;
+    }
+
+    if (*slot && txn_owns(txn, (*slot)->edit)) {
+        (*slot)->value = value;
+        return TRIE_OK;
+    }
+    if ((term = (seg_term *) zmalloc(sizeof(seg_term) + len)) == NULL) {
+        return TRIE_ERR;
+    }
+    term->value = value;
+    term->edit = txn_edit(txn);
+    term->len = len;
+    memcpy(term->key, pattern, len);
+    if (*slot) {
+        txn_drop(txn, *slot, (*slot)->edit);
+    } else {
+        t->size++;
+    }
+    *slot = term;
+    return TRIE_OK;
+}
+
+/* Remove pattern[pos..], which is stored, below the writable node n */
+static int seg_node_delete(seg_node *n, const char *pattern, size_t len,
+        size_t pos, trie_txn *txn)
+{
+    size_t l = seg_len(pattern + pos, len - pos);
+    seg_node *child;
+
+    if (seg_is(pattern + pos, l, SEG_TRIE_REST)) {
+        txn_drop(txn, n->rest, n->rest->edit);
+        n->rest = NULL;
+        return TRIE_OK;
+    }
+    if ((child = seg_node_writable_child(n, pattern + pos, l, 0, txn))
+            == NULL) {
+        return TRIE_ERR;
+    }
+    if (pos + l == len) {
+        txn_drop(txn, child->term, child->term->edit);
+        child->term = NULL;
+    } else if (seg_node_delete(child, pattern, len, pos + l + 1, txn) !=
+            TRIE_OK) {
+        return TRIE_ERR;
+    }
+    seg_node_prune(n, pattern + pos, l, child, txn);
+    return TRIE_OK;
+}
+
+/* Remove pattern, pruning the nodes left without purpose.
+ * Returns TRIE_ERR if pattern is not stored. */
+int seg_trie_delete(seg_trie *t, const char *pattern, size_t len,
+        trie_txn *txn)
+{
+    seg_node *root;
+
+    /* nothing is copied for a missing pattern */
+    if (seg_trie_find(t, pattern, len, NULL) != TRIE_OK ||
+            (root = seg_root_writable(t, txn)) == NULL ||
+            seg_node_delete(root, pattern, len, 0, txn) != TRIE_OK) {
+        return TRIE_ERR;
+    }
+    t->size--;
+    return TRIE_OK;
+}
+
+/* Look pattern up, its value is stored in value if it is not NULL.
+ * Returns TRIE_ERR if pattern is not stored. */
+int seg_trie_find(seg_trie *t, const char *pattern, size_t len,
+        void **value)
+{
+    seg_term **slot = seg_term_slot(t, pattern, len);
+
+    if (!slot || !*slot) {
+        return TRIE_ERR;
+    }
+    if (value) {
+        *value = (*slot)->value;
+    }
+    return TRIE_OK;
+}
+
+typedef struct seg_match_ctx {
+    const char *topic;
+    size_t len;
+    trie_walk_proc *proc;
+    void *privdata;
+    int count;
+} seg_match_ctx;
+
+static void seg_report(seg_term *term, seg_match_ctx *ctx)
+{
+    ctx->proc(term->key, term->len, term->value, ctx->privdata);
+    ctx->count++;
+}
+
+/* Match the topic segments from pos on below n, pos is past the end of the
+ * topic once every segment is consumed */
+static void seg_node_match(seg_node *n, size_t pos, seg_match_ctx *ctx)
+{
+    seg_node *child;
+    void *found;
+    size_t l;
+
+    if (pos > ctx->len) {
+        if (n->term) {
+            seg_report(n->term, ctx);
+        }
+        return;
+    }
+    if (n->rest) {
+        seg_report(n->rest, ctx);
+    }
+    l = seg_len(ctx->topic + pos, ctx->len - pos);
+    if (trie_find(&n->literals, ctx->topic + pos, l, &found) == TRIE_OK) {
+        child = (seg_node *) found;
+        seg_node_match(child, pos + l + 1, ctx);
+    }
+    if (n->one) {
+        seg_node_match(n->one, pos + l + 1, ctx);
+    }
+}
+
+/* Call proc for every stored pattern matching topic, with the pattern as
+ * the key. Returns the number of calls. */
+int seg_trie_match(seg_trie *t, const char *topic, size_t len,
+        trie_walk_proc *proc, void *privdata)
+{
+    seg_match_ctx ctx = {topic, len, proc, privdata, 0};
+
+    if (t->root) {
+        seg_node_match(t->root, 0, &ctx);
+    }
+    return ctx.count;
+}
+
+typedef struct seg_walk_ctx {
+    trie_walk_proc *proc;
+    void *privdata;
+} seg_walk_ctx;
+
+static void seg_node_walk(seg_node *n, seg_walk_ctx *ctx);
+
+static void walk_literal(const char *key, size_t len, void *child,
+        void *privdata)
+{
+    (void) key;
+    (void) len;
+    seg_node_walk((seg_node *) child, (seg_walk_ctx *) privdata);
+}
+
+static void seg_node_walk(seg_node *n, seg_walk_ctx *ctx)
+{
+    if (n->term) {
+        ctx->proc(n->term->key, n->term->len, n->term->value, ctx->privdata);
+    }
+    if (n->rest) {
+        ctx->proc(n->rest->key, n->rest->len, n->rest->value, ctx->privdata);
+    }
+    trie_walk(&n->literals, walk_literal, ctx);
+    if (n->one) {
+        seg_node_walk(n->one, ctx);
+    }
+}
+
+/* Call proc for every stored pattern, in no particular order. proc must not
+ * change the trie. */
+void seg_trie_walk(seg_trie *t, trie_walk_proc *proc, void *privdata)
+{
+    seg_walk_ctx ctx = {proc, privdata};
+
+    if (t->root) {
+        seg_node_walk(t->root, &ctx);
+    }
+}
+
+#ifdef TRIE_TEST_MAIN
+#include <stdio.h>
+#include <assert.h>
+
+/* Random inserts and deletes of short keys over a small alphabet, including
+ * zero bytes, checked against a plain array of the stored keys. */
+
+#define TEST_KEYS       512
+#define TEST_KEY_LEN    6
+#define TEST_ROUNDS     200000
+/* rounds made under the same txn */
+#define TEST_TXN_ROUNDS 16
+
+typedef struct key_test {
+    char key[TEST_KEY_LEN];
+    size_t len;
+    int stored;
+} key_test;
+
+typedef struct prefix_test {
+    const char *s;
+    size_t last;
+    int count;
+} prefix_test;
+
+static void test_prefix(const char *key, size_t len, void *value,
+        void *privdata)
+{
+    prefix_test *p = (prefix_test *) privdata;
+    key_test *k = (key_test *) value;
+
+    assert(key == p->s);
+    assert(p->count == 0 || len > p->last);
+    assert(k->stored && k->len == len && memcmp(k->key, key, len) == 0);
+    p->last = len;
+    p->count++;
+}
+
+static void test_walk(const char *key, size_t len, void *value,
+        void *privdata)
+{
+    key_test *k = (key_test *) value;
+
+    assert(k->stored && k->len == len && memcmp(k->key, key, len) == 0);
+    (*(size_t *) privdata)++;
+}
+
+/* Random patterns over a few segments and wildcards, each match checked
+ * against seg_match() on every stored pattern. */
+
+#define SEG_TEST_PATTERNS   256
+#define SEG_TEST_LEN        16
+
+typedef struct seg_key_test {
+    char key[SEG_TEST_LEN];
+    size_t len;
+    int stored;
+} seg_key_test;
+
+static void seg_test_random(unsigned int *seed, char *buf, size_t *len,
+        int wildcards)
+{
+    const char *segs[] = {"a", "bb", "", "*", ">"};
+    int i, nsegs = 1 + rand_r(seed) % 4;
+    size_t l;
+
+    *len = 0;
+    for (i = 0; i < nsegs; i++) {
+        const char *seg = segs[rand_r(seed) % (wildcards ? 5 : 3)];
+        if (i) {
+            buf[(*len)++] = SEG_TRIE_SEP;
+        }
+        l = strlen(seg);
+        memcpy(buf + *len, seg, l);
+        *len += l;
+    }
+}
+
+static void seg_test_count(const char *key, size_t len, void *value,
+        void *privdata)
+{
+    (void) key;
+    (void) len;
+    (void) value;
+    (*(int *) privdata)++;
+}
+
+static void seg_test_proc(const char *key, size_t len, void *value,
+        void *privdata)
+{
+    seg_key_test *k = (seg_key_test *) value;
+
+    assert(k->stored && k->len == len && memcmp(k->key, key, len) == 0);
+    (*(int *) privdata)++;
+}
+
+static void seg_test()
+{
+    seg_key_test keys[SEG_TEST_PATTERNS];
+    unsigned int seed = 2;
+    char topic[SEG_TEST_LEN];
+    size_t tlen, stored = 0;
+    int i, j, k, count, expect;
+    void *value;
+    seg_trie t;
+    trie_txn txn;
+
+    seg_trie_init(&t);
+    assert(seg_trie_match(&t, "md", 2, seg_test_count, &count) == 0);
+    assert(seg_trie_insert(&t, "md.*.AAPL", 9, NULL, NULL) == TRIE_OK);
+    assert(seg_trie_insert(&t, "md.>", 4, NULL, NULL) == TRIE_OK);
+    assert(seg_trie_insert(&t, "md.>.x", 6, NULL, NULL) == TRIE_ERR);
+    assert(seg_trie_insert(&t, "", 0, NULL, NULL) == TRIE_ERR);
+    count = 0;
+    assert(seg_trie_match(&t, "md.eq.AAPL", 10, seg_test_count, &count)
+            == 2);
+    assert(seg_trie_match(&t, "md", 2, seg_test_count, &count) == 0);
+    assert(seg_trie_match(&t, "md.eq.AAPL.x", 12, seg_test_count, &count)
+            == 1);
+    assert(seg_trie_delete(&t, "md.*", 4, NULL) == TRIE_ERR);
+    assert(seg_trie_delete(&t, "md.*.AAPL", 9, NULL) == TRIE_OK);
+    assert(seg_trie_delete(&t, "md.>", 4, NULL) == TRIE_OK);
+    assert(seg_trie_size(&t) == 0 && seg_node_empty(t.root));
+    seg_trie_clear(&t, NULL);
+
+    for (i = 0; i < SEG_TEST_PATTERNS; i++) {
+        do {
+            seg_test_random(&seed, keys[i].key, &keys[i].len, 1);
+            for (k = 0; k < i; k++) {
+                if (keys[k].len == keys[i].len &&
+                        memcmp(keys[k].key, keys[i].key, keys[i].len) == 0) {
+                    break;
+                }
+            }
+        } while (k < i || !seg_valid(keys[i].key, keys[i].len));
+        keys[i].stored = 0;
+    }
+
+    /* changed under txns which are restarted from time to time, so that
+     * both owned and shared nodes are changed */
+    seg_trie_init(&t);
+    trie_txn_begin(&txn);
+    for (i = 0; i < TEST_ROUNDS / 10; i++) {
+        if (i % TEST_TXN_ROUNDS == 0) {
+            trie_txn_free_garbage(&txn);
+            trie_txn_begin(&txn);
+        }
+        k = rand_r(&seed) % SEG_TEST_PATTERNS;
+        if (rand_r(&seed) % 2) {
+            assert(seg_trie_insert(&t, keys[k].key, keys[k].len, &keys[k],
+                        &txn) == TRIE_OK);
+            stored += !keys[k].stored;
+            keys[k].stored = 1;
+        } else {
+            assert(seg_trie_delete(&t, keys[k].key, keys[k].len, &txn) ==
+                    (keys[k].stored ? TRIE_OK : TRIE_ERR));
+            stored -= keys[k].stored;
+            keys[k].stored = 0;
+        }
+        assert(seg_trie_size(&t) == stored);
+        value = NULL;
+        assert(seg_trie_find(&t, keys[k].key, keys[k].len, &value) ==
+                (keys[k].stored ? TRIE_OK : TRIE_ERR));
+        assert(!keys[k].stored || value == &keys[k]);
+
+        seg_test_random(&seed, topic, &tlen, 0);
+        expect = 0;
+        for (j = 0; j < SEG_TEST_PATTERNS; j++) {
+            if (keys[j].stored &&
+                    seg_match(keys[j].key, keys[j].len, topic, tlen)) {
+                expect++;
+            }
+        }
+        count = 0;
+        assert(seg_trie_match(&t, topic, tlen, seg_test_proc, &count) ==
+                expect);
+        assert(count == expect);
+    }
+    trie_txn_free_garbage(&txn);
+
+    count = 0;
+    seg_trie_walk(&t, seg_test_proc, &count);
+    assert(count == (int) stored);
+    for (i = 0; i < SEG_TEST_PATTERNS; i++) {
+        if (keys[i].stored) {
+            assert(seg_trie_delete(&t, keys[i].key, keys[i].len, NULL) ==
+                    TRIE_OK);
+        }
+    }
+    assert(seg_trie_size(&t) == 0 && seg_node_empty(t.root));
+    seg_trie_clear(&t, NULL);
+}
+
+/* A trie and a segment trie of many keys are changed under a txn, the old
+ * versions must stay as they were and only a few nodes may be replaced. */
+
+#define TXN_TEST_KEYS   10000
+
+static void txn_test()
+{
+    trie old, cur;
+    seg_trie old_patterns, patterns;
+    trie_txn txn;
+    char key[32];
+    size_t len, i;
+    int count = 0;
+    void *value;
+
+    trie_init(&old);
+    seg_trie_init(&old_patterns);
+    for (i = 0; i < TXN_TEST_KEYS; i++) {
+        len = snprintf(key, sizeof(key), "md.%zu", i * 7);
+        assert(trie_insert(&old, key, len, (void *) i, NULL) == TRIE_OK);
+        len = snprintf(key, sizeof(key), "md.*.%zu", i * 7);
+        assert(seg_trie_insert(&old_patterns, key, len, (void *) i, NULL)
+                == TRIE_OK);
+    }
+
+    cur = old;
+    patterns = old_patterns;
+    trie_txn_begin(&txn);
+    assert(trie_insert(&cur, "md.1", 4, NULL, &txn) == TRIE_OK);
+    assert(trie_insert(&cur, "md.7", 4, NULL, &txn) == TRIE_OK);
+    assert(trie_delete(&cur, "md.14", 5, &txn) == TRIE_OK);
+    assert(seg_trie_insert(&patterns, "md.*.1", 6, NULL, &txn) == TRIE_OK);
+    assert(seg_trie_insert(&patterns, "md.*.7", 6, NULL, &txn) == TRIE_OK);
+    assert(seg_trie_delete(&patterns, "md.*.14", 7, &txn) == TRIE_OK);
+    assert(seg_trie_insert(&patterns, "md.>", 4, NULL, &txn) == TRIE_OK);
+    i = txn.ngarbage;
+    assert(trie_delete(&cur, "md.2", 4, &txn) == TRIE_ERR);
+    assert(seg_trie_delete(&patterns, "md.*.2", 6, &txn) == TRIE_ERR);
+    assert(txn.ngarbage == i);
+    /* each change copies its path, not the trie */
+    assert(txn.ngarbage < 64);
+
+    for (i = 0; i < TXN_TEST_KEYS; i++) {
+        len = snprintf(key, sizeof(key), "md.%zu", i * 7);
+        assert(trie_find(&old, key, len, &value) == TRIE_OK &&
+                value == (void *) i);
+        len = snprintf(key, sizeof(key), "md.*.%zu", i * 7);
+        assert(seg_trie_find(&old_patterns, key, len, &value) == TRIE_OK &&
+                value == (void *) i);
+    }
+    assert(trie_size(&old) == TXN_TEST_KEYS);
+    assert(trie_find(&old, "md.1", 4, NULL) == TRIE_ERR);
+    assert(seg_trie_size(&old_patterns) == TXN_TEST_KEYS);
+    assert(seg_trie_find(&old_patterns, "md.>", 4, NULL) == TRIE_ERR);
+
+    assert(trie_size(&cur) == TXN_TEST_KEYS);
+    assert(trie_find(&cur, "md.7", 4, &value) == TRIE_OK && !value);
+    assert(trie_find(&cur, "md.14", 5, NULL) == TRIE_ERR);
+    assert(trie_find(&cur, "md.21", 5, &value) == TRIE_OK &&
+            value == (void *) 3);
+    assert(seg_trie_size(&patterns) == TXN_TEST_KEYS + 1);
+    assert(seg_trie_find(&patterns, "md.*.7", 6, &value) == TRIE_OK &&
+            !value);
+    assert(seg_trie_find(&patterns, "md.*.14", 7, NULL) == TRIE_ERR);
+    assert(seg_trie_match(&patterns, "md.eq.21", 8, seg_test_count, &count)
+            == 2);
+
+    /* the old versions are gone once what the txn replaced is freed */
+    trie_txn_free_garbage(&txn);
+    trie_clear(&cur, NULL);
+    seg_trie_clear(&patterns, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    const char alphabet[] = {'a', 'b', '.', '\0'};
+    key_test keys[TEST_KEYS];
+    prefix_test p;
+    unsigned int seed = 1;
+    size_t stored = 0, walked;
+    void *value;
+    int i, j, k, expect;
+    trie t;
+    trie_txn txn;
+    (void) argc;
+    (void) argv;
+
+    printf("trie_test starts...\n");
+
+    trie_init(&t);
+    assert(trie_size(&t) == 0 && trie_find(&t, "", 0, NULL) == TRIE_ERR);
+    assert(trie_insert(&t, "md.eq", 5, NULL, NULL) == TRIE_OK);
+    assert(trie_insert(&t, "md", 2, NULL, NULL) == TRIE_OK);
+    assert(trie_find(&t, "md.", 3, NULL) == TRIE_ERR);
+    assert(trie_delete(&t, "md.", 3, NULL) == TRIE_ERR);
+    assert(trie_delete(&t, "md", 2, NULL) == TRIE_OK);
+    assert(trie_find(&t, "md.eq", 5, NULL) == TRIE_OK);
+    assert(trie_size(&t) == 1);
+    trie_clear(&t, NULL);
+
+    /* distinct random keys */
+    for (i = 0; i < TEST_KEYS; i++) {
+        do {
+            keys[i].len = rand_r(&seed) % (TEST_KEY_LEN + 1);
+            for (j = 0; j < (int) keys[i].len; j++) {
+                keys[i].key[j] = alphabet[rand_r(&seed) % sizeof(alphabet)];
+            }
+            for (k = 0; k < i; k++) {
+                if (keys[k].len == keys[i].len &&
+                        memcmp(keys[k].key, keys[i].key, keys[i].len) == 0) {
+                    break;
+                }
+            }
+        } while (k < i);
+        keys[i].stored = 0;
+    }
+
+    trie_init(&t);
+    trie_txn_begin(&txn);
+    for (i = 0; i < TEST_ROUNDS; i++) {
+        if (i % TEST_TXN_ROUNDS == 0) {
+            trie_txn_free_garbage(&txn);
+            trie_txn_begin(&txn);
+        }
+        k = rand_r(&seed) % TEST_KEYS;
+        if (rand_r(&seed) % 2) {
+            assert(trie_insert(&t, keys[k].key, keys[k].len, &keys[k], &txn)
+                    == TRIE_OK);
+            stored += !keys[k].stored;
+            keys[k].stored = 1;
+        } else {
+            assert(trie_delete(&t, keys[k].key, keys[k].len, &txn) ==
+                    (keys[k].stored ? TRIE_OK : TRIE_ERR));
+            stored -= keys[k].stored;
+            keys[k].stored = 0;
+        }
+        assert(trie_size(&t) == stored);
+
+        k = rand_r(&seed) % TEST_KEYS;
+        value = NULL;
+        assert(trie_find(&t, keys[k].key, keys[k].len, &value) ==
+                (keys[k].stored ? TRIE_OK : TRIE_ERR));
+        assert(!keys[k].stored || value == &keys[k]);
+
+        expect = 0;
+        for (j = 0; j < TEST_KEYS; j++) {
+            if (keys[j].stored && keys[j].len <= keys[k].len &&
+                    memcmp(keys[j].key, keys[k].key, keys[j].len) == 0) {
+                expect++;
+            }
+        }
+        p.s = keys[k].key;
+        p.count = 0;
+        assert(trie_prefixes(&t, p.s, keys[k].len, test_prefix, &p) == expect);
+        assert(p.count == expect);
+    }
+    trie_txn_free_garbage(&txn);
+
+    walked = 0;
+    assert(trie_walk(&t, test_walk, &walked) == TRIE_OK);
+    assert(walked == stored);
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        if (keys[i].stored) {
+            assert(trie_delete(&t, keys[i].key, keys[i].len, NULL) ==
+                    TRIE_OK);
+        }
+    }
+    assert(trie_size(&t) == 0);
+    /* every node was pruned */
+    assert(t.root->nchildren == 0);
+    trie_clear(&t, NULL);
+
+    seg_test();
+    txn_test();
+
+    printf("trie_test ok\n");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,145 @@
+#ifndef __TRIE_H
+#define __TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRIE_OK     0
+#define TRIE_ERR    -1
+
+/* A radix tree over raw bytes, keys may hold any byte including 0.
+ *
+ * A node keeps the bytes of the edge leading to it, and each node is a
+ * single allocation holding its header, its edge bytes, the first byte of
+ * the edge of every child and the child pointers, in this order. A walk
+ * thus reads one cache line to pick the next child in most cases.
+ *
+ * A trie may be shared with readers and changed under a trie_txn, see
+ * below, or changed in place when no txn is given.
+ * */
+
+typedef void trie_free_fn(void *ptr);
+
+typedef struct trie_garbage {
+    void *ptr;
+    trie_free_fn *fn;
+} trie_garbage;
+
+/* A batch of changes to tries which readers may be walking.
+ *
+ * Nodes created under a txn are private to it and changed in place. Any
+ * other node is copied before it is changed, and so is the path leading to
+ * it, so a change costs the length of its path whatever the size of the
+ * trie, and the old root still leads to the trie as it was. The nodes
+ * replaced this way are recorded in the txn, to be freed once no reader
+ * can see the old version any more.
+ * */
+typedef struct trie_txn {
+    /* unique, objects created under the txn carry it as their edit id */
+    uint64_t id;
+    trie_garbage *garbage;
+    size_t ngarbage;
+    size_t cap;
+} trie_txn;
+
+typedef struct trie_node {
+    /* value of the key ending at this node, if terminal */
+    void *value;
+    /* id of the txn which created the node, 0 without one */
+    uint64_t edit;
+    uint32_t label_len;
+    uint16_t nchildren;
+    uint16_t cap;
+    uint8_t terminal;
+    /* label[label_len], keys[cap], then aligned children[cap] */
+    char data[];
+} trie_node;
+
+typedef struct trie {
+    /* NULL until a key is stored */
+    trie_node *root;
+    size_t size;
+} trie;
+
+/* Called for every stored key which is a prefix of the queried string, the
+ * key is the first len bytes of that string. */
+typedef void trie_prefix_proc(const char *key, size_t len, void *value,
+        void *privdata);
+
+/* Called for every stored key by trie_walk(), key is only valid during the
+ * call. */
+typedef void trie_walk_proc(const char *key, size_t len, void *value,
+        void *privdata);
+
+void trie_txn_begin(trie_txn *txn);
+void trie_txn_retire(trie_txn *txn, void *ptr, trie_free_fn *fn);
+void trie_txn_free_garbage(trie_txn *txn);
+
+void trie_init(trie *t);
+void trie_clear(trie *t, trie_txn *txn);
+size_t trie_size(trie *t);
+int trie_insert(trie *t, const char *key, size_t len, void *value,
+        trie_txn *txn);
+int trie_delete(trie *t, const char *key, size_t len, trie_txn *txn);
+int trie_find(trie *t, const char *key, size_t len, void **value);
+int trie_prefixes(trie *t, const char *s, size_t len, trie_prefix_proc *proc,
+        void *privdata);
+int trie_walk(trie *t, trie_walk_proc *proc, void *privdata);
+
+/* Patterns of segments separated by SEG_TRIE_SEP, where a "*" segment
+ * matches any one segment and a last ">" segment matches one or more
+ * trailing segments, e.g. "md.*.AAPL" and "md.>" both match "md.eq.AAPL".
+ *
+ * The patterns share a trie of segments, each node keeping its literal
+ * edges in a byte trie and its wildcard edges apart, so matching a topic
+ * costs a walk per segment and wildcard branch taken, whatever the number
+ * of patterns. Segment nodes and patterns are copied on change under a
+ * trie_txn like the nodes of a trie.
+ * */
+
+#define SEG_TRIE_SEP    '.'
+#define SEG_TRIE_ONE    '*'
+#define SEG_TRIE_REST   '>'
+
+/* a stored pattern, the key is kept to be handed back on matches */
+typedef struct seg_term {
+    void *value;
+    uint64_t edit;
+    size_t len;
+    char key[];
+} seg_term;
+
+typedef struct seg_node {
+    /* children through literal segments */
+    trie literals;
+    /* child through a "*" segment */
+    struct seg_node *one;
+    /* pattern ending at this node */
+    seg_term *term;
+    /* pattern ending at this node with a ">" segment */
+    seg_term *rest;
+    uint64_t edit;
+} seg_node;
+
+typedef struct seg_trie {
+    /* NULL until a pattern is stored */
+    seg_node *root;
+    size_t size;
+} seg_trie;
+
+void seg_trie_init(seg_trie *t);
+void seg_trie_clear(seg_trie *t, trie_txn *txn);
+size_t seg_trie_size(seg_trie *t);
+int seg_trie_insert(seg_trie *t, const char *pattern, size_t len,
+        void *value, trie_txn *txn);
+int seg_trie_delete(seg_trie *t, const char *pattern, size_t len,
+        trie_txn *txn);
+int seg_trie_find(seg_trie *t, const char *pattern, size_t len,
+        void **value);
+int seg_trie_match(seg_trie *t, const char *topic, size_t len,
+        trie_walk_proc *proc, void *privdata);
+void seg_trie_walk(seg_trie *t, trie_walk_proc *proc, void *privdata);
+int seg_match(const char *pattern, size_t plen, const char *topic,
+        size_t tlen);
+
+#endif
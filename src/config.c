@@ -8,6 +8,31 @@
 #include "cJSON.h"
 #include "config.h"
 #include "constant.h"
+#include "subcli.h"
+
+static void load_obuf_limit(cJSON *limits, char *class_name,
+        obuf_limit *limit)
+{
+    cJSON *json = cJSON_GetObjectItem(limits, class_name);
+    if (!json) {
+        return;
+    }
+
+    cJSON *hard_limit = cJSON_GetObjectItem(json, "hard_limit");
+    if (hard_limit) {
+        limit->hard_limit = (size_t) hard_limit->valuedouble;
+    }
+
+    cJSON *soft_limit = cJSON_GetObjectItem(json, "soft_limit");
+    if (soft_limit) {
+        limit->soft_limit = (size_t) soft_limit->valuedouble;
+    }
+
+    cJSON *soft_seconds = cJSON_GetObjectItem(json, "soft_seconds");
+    if (soft_seconds) {
+        limit->soft_seconds = soft_seconds->valueint;
+    }
+}
 
 int srv_load_cfg(char *cfg_path)
 {
@@ -57,6 +82,40 @@ int srv_load_cfg(char *cfg_path)
         server.sub_port = sub_port->valueint;
     }
 
+    cJSON *io_threads = cJSON_GetObjectItem(config_json, "io_threads");
+    if (io_threads) {
+        if (io_threads->valueint <= 0 ||
+                io_threads->valueint > IO_THREADS_MAX) {
+            srv_log(LOG_ERROR, "io_threads must be between 1 and %d",
+                    IO_THREADS_MAX);
+            cJSON_Delete(config_json);
+            return CONFIG_ERR;
+        }
+        server.io_threads = io_threads->valueint;
+    }
+
+    cJSON *match_cache_size = cJSON_GetObjectItem(config_json,
+            "match_cache_size");
+    if (match_cache_size) {
+        if (match_cache_size->valueint < 0) {
+            srv_log(LOG_ERROR, "match_cache_size must not be negative");
+            cJSON_Delete(config_json);
+            return CONFIG_ERR;
+        }
+        server.match_cache_size = match_cache_size->valueint;
+    }
+
+    cJSON *max_message_len = cJSON_GetObjectItem(config_json,
+            "max_message_len");
+    if (max_message_len) {
+        if (max_message_len->valuedouble < 1) {
+            srv_log(LOG_ERROR, "max_message_len must be positive");
+            cJSON_Delete(config_json);
+            return CONFIG_ERR;
+        }
+        server.max_msg_len = (size_t) max_message_len->valuedouble;
+    }
+
     cJSON *log_file = cJSON_GetObjectItem(config_json, "log_file");
     if (log_file) {
         server.log_file = strdup(log_file->valuestring);
@@ -68,6 +127,38 @@ int srv_load_cfg(char *cfg_path)
         server.pid_file = strdup(pid_file->valuestring);
     }
 
+    cJSON *obuf_limits = cJSON_GetObjectItem(config_json,
+            "output_buffer_limits");
+    if (obuf_limits) {
+        load_obuf_limit(obuf_limits, "normal",
+                &server.obuf_limits[SUBCLI_CLASS_NORMAL]);
+        load_obuf_limit(obuf_limits, "pubsub",
+                &server.obuf_limits[SUBCLI_CLASS_PUBSUB]);
+    }
+
+    cJSON *admin_commands = cJSON_GetObjectItem(config_json,
+            "admin_commands");
+    if (admin_commands && admin_commands->type == cJSON_False) {
+        server.denied_cmd_flags |= CMD_ADMIN;
+    }
+
+    cJSON *slow_policy = cJSON_GetObjectItem(config_json,
+            "slow_consumer_policy");
+    if (slow_policy) {
+        if (slow_policy->type != cJSON_String) {
+            srv_log(LOG_ERROR, "slow_consumer_policy must be a string");
+            cJSON_Delete(config_json);
+            return CONFIG_ERR;
+        }
+        server.slow_policy = get_slow_policy(slow_policy->valuestring);
+        if (server.slow_policy == -1) {
+            srv_log(LOG_ERROR, "invalid slow_consumer_policy: %s",
+                    slow_policy->valuestring);
+            cJSON_Delete(config_json);
+            return CONFIG_ERR;
+        }
+    }
+
     cJSON_Delete(config_json);
 
     return CONFIG_OK;
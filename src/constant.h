@@ -15,14 +15,52 @@
 #define TCP_PUB_BACKLOG     511
 #define TCP_SUB_BACKLOG     511
 
+#define IO_THREADS_DFLT     1
+#define IO_THREADS_MAX      64
+#define WORKER_RING_LEN     4096
+/* how often the deliveries waiting for room in the ring to a worker are
+ * retried */
+#define WORKER_SPILL_RETRY_MS   1
+#define WORKER_CRON_MS      100
+
 #define PUB_READ_BUF_LEN    (1024*16)
 #define SUB_READ_BUF_LEN    (1024*16)
-#define SUB_WRITE_BUF_LEN   (1024*16)
+#define SUB_WRITE_BUF_LEN   (1024*1)
+#define SUB_WRITE_IOV_MAX   SIZE64
+#define SUB_REPLY_INIT_LEN  SIZE16
+#define SUB_REPLY_CHUNK_LEN (1024*16)
 #define MAX_INLINE_READ     (1024*16)
+/* max length of a bulk string other than a published payload */
 #define MAX_BULK_LEN        (1024*16)
+/* published payloads from this length on are read straight into their
+ * message instead of the publisher read buffer */
+#define PUB_STREAM_MIN_LEN  (1024*16)
 
 #define CLIENT_ID_LEN       24
 
+/* subscribe client classes, which have their own output buffer limits */
+#define SUBCLI_CLASS_NORMAL 0
+#define SUBCLI_CLASS_PUBSUB 1
+#define SUBCLI_CLASS_COUNT  2
+
+/* default output buffer limits, 0 means no limit */
+#define OBUF_NORMAL_HARD_DFLT       0
+#define OBUF_NORMAL_SOFT_DFLT       0
+#define OBUF_NORMAL_SOFT_SECS_DFLT  0
+#define OBUF_PUBSUB_HARD_DFLT       (1024*1024*32)
+#define OBUF_PUBSUB_SOFT_DFLT       (1024*1024*8)
+#define OBUF_PUBSUB_SOFT_SECS_DFLT  60
+
+/* what to do with a subscriber whose output overcomes the limits */
+#define SLOW_POLICY_DISCONNECT      0
+#define SLOW_POLICY_DROP_OLDEST     1
+#define SLOW_POLICY_CONFLATE        2
+#define SLOW_POLICY_DFLT            SLOW_POLICY_DISCONNECT
+
+/* topics whose subscribers each I/O thread caches, 0 disables the cache */
+#define MATCH_CACHE_SIZE_DFLT       SIZE1024
+#define MAX_MESSAGE_LEN_DFLT        (1024*1024*8)
+
 #define SIZE4               4
 #define SIZE8               8
 #define SIZE16              16
@@ -36,6 +74,7 @@
 #define NET_ERR_LEN         SIZE256
 
 #define SUB_SET_LEN         SIZE16
+#define SUB_ARGV_LEN        SIZE8
 
 #define BROKER_OK           0
 #define BROKER_ERR          -1
@@ -43,6 +82,9 @@
 #define SUBCLI_OK           0
 #define SUBCLI_ERR          -1
 
+#define PUBCLI_OK           0
+#define PUBCLI_ERR          -1
+
 #define INT64               int64_t
 
 #endif
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "net.h"
 #include "event.h"
@@ -12,6 +13,7 @@
 #include "pubcli.h"
 #include "subcli.h"
 #include "constant.h"
+#include "worker.h"
 
 static int accept_tcp_handler(evutil_socket_t fd, short event, void *args);
 static void pub_ev_handler(evutil_socket_t fd, short event, void *args);
@@ -20,12 +22,12 @@ static int accept_tcp_handler(evutil_socket_t fd, short event, void *args)
 {
     int cport, cfd;
     char cip[IP_STR_LEN];
+    worker *w = (worker *) args;
     (void) event;
-    (void) args;
 
-    cfd = net_tcp_accept(server.neterr, fd, cip, sizeof(cip), &cport);
+    cfd = net_tcp_accept(w->neterr, fd, cip, sizeof(cip), &cport);
     if (cfd == -1) {
-        srv_log(LOG_WARN, "Accepting client connection: %s", server.neterr);
+        srv_log(LOG_WARN, "Accepting client connection: %s", w->neterr);
         return -1;
     }
     srv_log(LOG_INFO, "Accepted %s:%d", cip, cport);
@@ -35,15 +37,28 @@ static int accept_tcp_handler(evutil_socket_t fd, short event, void *args)
 static void pub_ev_handler(evutil_socket_t fd, short event, void *args)
 {
     if (!(event & EV_READ)) {
-        srv_log(LOG_WARN, "publisher [fd %d] invalid event: %d", event);
+        srv_log(LOG_WARN, "publisher [fd %d] invalid event: %d", fd, event);
         return;
     }
 
     pub_client *c = (pub_client *) args;
+    struct iovec iov[2];
+    size_t streamed = 0;
+    int iovcnt = 0;
 
+    /* the rest of a large payload goes straight into its message, what
+     * follows it into the read buffer */
+    if (c->stream_msg) {
+        iov[iovcnt].iov_base = pub_cli_stream_buf(c);
+        iov[iovcnt].iov_len = c->stream_left;
+        iovcnt++;
+    }
     c->read_buf = sdsMakeRoomFor(c->read_buf, PUB_READ_BUF_LEN);
     size_t cur_len = sdslen(c->read_buf);
-    int nread = read(fd, c->read_buf + cur_len, PUB_READ_BUF_LEN);
+    iov[iovcnt].iov_base = c->read_buf + cur_len;
+    iov[iovcnt].iov_len = PUB_READ_BUF_LEN;
+    iovcnt++;
+    ssize_t nread = readv(fd, iov, iovcnt);
     if (nread == -1) {
         if (errno == EAGAIN || errno == EINTR) {
             /* temporary unavailable */
@@ -56,15 +71,21 @@ static void pub_ev_handler(evutil_socket_t fd, short event, void *args)
         srv_log(LOG_INFO, "[fd %d] publisher detached", fd);
         pub_cli_release(c);
     } else {
-        /*
-        chunk[n] = '\0';
-        srv_log(LOG_INFO, "[fd %d] publisher send: %s", fd, chunk);
-        write(fd, "hello", 5);
-        */
-        /* data process */
-        sdsIncrLen(c->read_buf, nread);
-        process_pub_read_buf(c);
-        /*process_publish(c, chunk, nread);*/
+        worker *w = c->worker;
+        if (c->stream_msg) {
+            streamed = (size_t) nread < c->stream_left ?
+                (size_t) nread : c->stream_left;
+        }
+        if (streamed && pub_cli_stream_read(c, streamed) != PUBCLI_OK) {
+            pub_cli_release(c);
+        } else {
+            sdsIncrLen(c->read_buf, nread - streamed);
+            if (process_pub_read_buf(c) != PUBCLI_OK) {
+                pub_cli_release(c);
+            }
+        }
+        /* one wakeup per worker for everything published by this read */
+        worker_wakeup_pending(w);
     }
 }
 
@@ -105,10 +126,12 @@ void accept_pub_handler(evutil_socket_t fd, short event, void *args)
     if (cfd == -1) {
         return;
     }
+    worker *w = (worker *) args;
     pub_client *c = pub_cli_create(cfd);
+    c->worker = w;
     net_tcp_set_nonblock(NULL, cfd);
     net_enable_tcp_no_delay(NULL, cfd);
-    struct event *pub_ev = event_new(server.evloop, cfd, EV_READ|EV_PERSIST,
+    struct event *pub_ev = event_new(w->evloop, cfd, EV_READ|EV_PERSIST,
             pub_ev_handler, c);
     if (pub_ev == NULL) {
         free(c);
@@ -125,18 +148,24 @@ void accept_sub_handler(evutil_socket_t fd, short event, void *args)
     if (cfd == -1) {
         return;
     }
-    sub_client *c = sub_cli_create(cfd, ++server.sub_inc_counter);
+    worker *w = (worker *) args;
+    sub_client *c = sub_cli_create(cfd,
+            atomic_incr(&server.sub_inc_counter, 1));
+    c->worker = w;
     net_tcp_set_nonblock(NULL, cfd);
     net_enable_tcp_no_delay(NULL, cfd);
-    struct event *sub_ev = event_new(server.evloop, cfd,
-            EV_READ|EV_PERSIST, sub_ev_handler, c);
-    if (sub_ev == NULL) {
-        free(c);
-        close(cfd);
+    c->rev = event_new(w->evloop, cfd, EV_READ|EV_PERSIST,
+            sub_ev_handler, c);
+    c->wev = event_new(w->evloop, cfd, EV_WRITE|EV_PERSIST,
+            sub_ev_handler, c);
+    if (c->rev == NULL || c->wev == NULL) {
+        sub_cli_release(c);
+        return;
+    }
+    if (worker_add_client(w, c) != BROKER_OK) {
+        sub_cli_release(c);
         return;
     }
-    event_add(sub_ev, NULL);
-    c->ev = sub_ev;
-    ght_insert(server.subcli_table, c, CLIENT_ID_LEN, c->id);
+    event_add(c->rev, NULL);
 }
 
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "message.h"
+#include "zmalloc.h"
+#include "util.h"
+
+/* max length of the "$<len>\r\n" bulk header */
+#define BULK_HDR_LEN    32
+
+/* Create an empty command reply with room for cap bytes, with refcount of
+ * 1 */
+message *msg_create_reply(size_t cap)
+{
+    message *m = (message *) zmalloc(sizeof(message) + cap);
+    if (!m) {
+        return NULL;
+    }
+    m->refcount = 1;
+    m->flags = 0;
+    m->payload = NULL;
+    m->topic = NULL;
+    m->topic_len = 0;
+    m->len = 0;
+    m->cap = cap;
+    return m;
+}
+
+/* Create a message holding payload encoded as "$<len>\r\n<payload>\r\n".
+ * The message also keeps a copy of its topic, NULL if it has none, and is
+ * flagged as published so slow consumer policies may drop or conflate it.
+ * With a NULL payload the payload_len bytes at m->payload are left for the
+ * caller to fill in. */
+message *msg_create_pub(const char *topic, size_t topic_len,
+        const char *payload, size_t payload_len)
+{
+    size_t cap = BULK_HDR_LEN + payload_len + 2 + topic_len;
+    message *m = (message *) zmalloc(sizeof(message) + cap);
+    if (!m) {
+        return NULL;
+    }
+    m->refcount = 1;
+    m->flags = MSG_PUBLISHED | (topic ? MSG_HAS_TOPIC : 0);
+    m->cap = cap;
+    m->len = snprintf(m->data, BULK_HDR_LEN, "$%zu\r\n", payload_len);
+    m->payload = m->data + m->len;
+    if (payload) {
+        memcpy(m->payload, payload, payload_len);
+    }
+    m->len += payload_len;
+    m->data[m->len++] = '\r';
+    m->data[m->len++] = '\n';
+    m->topic = m->data + m->len;
+    m->topic_len = topic ? topic_len : 0;
+    if (m->topic_len) {
+        memcpy(m->topic, topic, topic_len);
+    }
+    return m;
+}
+
+/* The bytes a published message is matched on: its topic, or its payload if
+ * it was published without one */
+const char *msg_topic(message *m, size_t *len)
+{
+    if (m->flags & MSG_HAS_TOPIC) {
+        *len = m->topic_len;
+        return m->topic;
+    }
+    *len = m->topic - m->payload - 2;
+    return m->payload;
+}
+
+void msg_incr_ref(message *m)
+{
+    atomic_incr(&m->refcount, 1);
+}
+
+void msg_decr_ref(message *m)
+{
+    if (atomic_decr(&m->refcount, 1) == 0) {
+        zfree(m);
+    }
+}
+
+#ifdef MESSAGE_TEST_MAIN
+#include <assert.h>
+#include <stdlib.h>
+
+/* the payload length from which publishers stream into the message,
+ * PUB_STREAM_MIN_LEN */
+#define TEST_STREAM_LEN (1024*16)
+
+int main(int argc, char *argv[])
+{
+    char *payload = malloc(TEST_STREAM_LEN + 1);
+    const char *topic;
+    message *m;
+    size_t len, sizes[] = {TEST_STREAM_LEN - 1, TEST_STREAM_LEN}, i;
+    (void) argc;
+    (void) argv;
+
+    printf("message_test starts...\n");
+
+    memset(payload, 'p', TEST_STREAM_LEN + 1);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        /* an empty topic is a topic, never the payload, whether the
+         * payload is copied in or filled in later */
+        m = msg_create_pub("", 0, payload, sizes[i]);
+        assert(m->flags & MSG_HAS_TOPIC);
+        topic = msg_topic(m, &len);
+        assert(len == 0 && topic == m->topic);
+        msg_decr_ref(m);
+
+        m = msg_create_pub("", 0, NULL, sizes[i]);
+        memcpy(m->payload, payload, sizes[i]);
+        assert(m->flags & MSG_HAS_TOPIC);
+        assert(msg_topic(m, &len) == m->topic && len == 0);
+        msg_decr_ref(m);
+
+        /* without a topic the payload is matched */
+        m = msg_create_pub(NULL, 0, payload, sizes[i]);
+        assert(!(m->flags & MSG_HAS_TOPIC));
+        assert(msg_topic(m, &len) == m->payload && len == sizes[i]);
+        assert(memcmp(m->payload + sizes[i], "\r\n", 2) == 0);
+        msg_decr_ref(m);
+
+        m = msg_create_pub("t.a", 3, payload, sizes[i]);
+        topic = msg_topic(m, &len);
+        assert(len == 3 && memcmp(topic, "t.a", 3) == 0);
+        msg_decr_ref(m);
+    }
+    free(payload);
+
+    printf("message_test ok\n");
+
+    return 0;
+}
+#endif
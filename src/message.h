@@ -0,0 +1,42 @@
+#ifndef __MESSAGE_H
+#define __MESSAGE_H
+
+#include <stddef.h>
+
+/* A reference counted chunk of wire data.
+ *
+ * A published payload is encoded once as a RESP bulk string and the same
+ * message is queued by reference to every subscriber it is delivered to. It
+ * is freed when the last reference is dropped. Published messages are
+ * immutable, command replies are only referenced by their client and later
+ * replies are appended to the last one while it has room.
+ * */
+/* message flags */
+#define MSG_PUBLISHED   (1<<0)  /* a published payload, not a command reply */
+#define MSG_HAS_TOPIC   (1<<1)  /* published with a topic, maybe empty, and
+                                   not matched on its payload */
+
+typedef struct message {
+    /* updated atomically, a message may be shared by several workers */
+    int refcount;
+    int flags;
+    /* payload of a published message, points into data */
+    char *payload;
+    /* topic of a published message, points into data after the wire bytes,
+     * only set with MSG_HAS_TOPIC */
+    char *topic;
+    size_t topic_len;
+    size_t len;
+    /* bytes allocated for data */
+    size_t cap;
+    char data[];
+} message;
+
+message *msg_create_reply(size_t cap);
+message *msg_create_pub(const char *topic, size_t topic_len,
+        const char *payload, size_t payload_len);
+const char *msg_topic(message *m, size_t *len);
+void msg_incr_ref(message *m);
+void msg_decr_ref(message *m);
+
+#endif
@@ -57,7 +57,17 @@ static int net_set_reuse_addr(char *err, int fd) {
     return NET_OK;
 }
 
-static int _net_tcp_server(char *err, int port, char *bindaddr, int af, int backlog)
+static int net_set_reuse_port(char *err, int fd) {
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        net_set_error(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+        return NET_ERR;
+    }
+    return NET_OK;
+}
+
+static int _net_tcp_server(char *err, int port, char *bindaddr, int af,
+        int backlog, int reuseport)
 {
     int s, rv;
     char _port[6];  /* strlen("65535") */
@@ -79,6 +89,7 @@ static int _net_tcp_server(char *err, int port, char *bindaddr, int af, int back
 
         if (af == AF_INET6 && anetV6Only(err, s) == NET_ERR) goto error;
         if (net_set_reuse_addr(err, s) == NET_ERR) goto error;
+        if (reuseport && net_set_reuse_port(err, s) == NET_ERR) goto error;
         if (net_listen(err, s, p->ai_addr, p->ai_addrlen, backlog) == NET_ERR) {
             goto error;
         }
@@ -98,7 +109,14 @@ end:
 
 int net_tcp_server(char *err, int port, char *bindaddr, int backlog)
 {
-    return _net_tcp_server(err, port, bindaddr, AF_INET, backlog);
+    return _net_tcp_server(err, port, bindaddr, AF_INET, backlog, 0);
+}
+
+/* Like net_tcp_server, but several sockets may listen on the same port and
+ * the kernel balances the incoming connections among them. */
+int net_tcp_server_reuseport(char *err, int port, char *bindaddr, int backlog)
+{
+    return _net_tcp_server(err, port, bindaddr, AF_INET, backlog, 1);
 }
 
 int net_tcp_set_nonblock(char *err, int fd)
@@ -1,14 +1,18 @@
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <event2/event.h>
 
 #include "pubcli.h"
 #include "subcli.h"
 #include "zmalloc.h"
-#include "trie_util.h"
 #include "broker.h"
 #include "util.h"
-#include "hset.h"
+#include "message.h"
+#include "worker.h"
+#include "subindex.h"
+#include "scan.h"
 
 pub_client *pub_cli_create(int fd)
 {
@@ -18,8 +22,12 @@ pub_client *pub_cli_create(int fd)
     }
     c->fd = fd;
     c->ev = NULL;
+    c->worker = NULL;
     c->read_buf = sdsempty();
     c->write_buf = sdsempty();
+    c->bulk_len = -1;
+    c->stream_msg = NULL;
+    c->stream_left = 0;
     return c;
 }
 
@@ -30,49 +38,363 @@ void pub_cli_release(pub_client *c)
     }
     sdsfree(c->read_buf);
     sdsfree(c->write_buf);
-    event_del((struct event *)(c->ev));
+    if (c->stream_msg) {
+        msg_decr_ref(c->stream_msg);
+    }
+    if (c->ev) {
+        event_free((struct event *)(c->ev));
+    }
+    close(c->fd);
     zfree(c);
 }
 
-static void single_chan_publish(sds msg, char *chan, size_t chan_len)
+static void set_protocol_err(pub_client *c, const char *reason)
+{
+    srv_log(LOG_ERROR, "[fd %d] protocol error from publisher: %s",
+            c->fd, reason);
+    c->write_buf = sdscatprintf(c->write_buf, "-ERR Protocol error: %s\r\n",
+            reason);
+    /* best effort, the connection is closed right after */
+    if (write(c->fd, c->write_buf, sdslen(c->write_buf)) == -1) {
+        srv_log(LOG_DEBUG, "[fd %d] failed to send error to publisher", c->fd);
+    }
+}
+
+/* A message being published, the wire message is only built once some
+ * subscriber matches */
+typedef struct publish_ctx {
+    worker *worker;
+    message *msg;
+    const char *topic;
+    size_t topic_len;
+    const char *payload;
+    size_t payload_len;
+} publish_ctx;
+
+static void single_sub_publish(const char *chan, size_t chan_len,
+        void *sub, void *privdata)
 {
-    hset *sub_set;
-    hset_iterator iter;
-    void *sub_cli;
-    const void *client_id;
-
-    /* subscibe set stores mapping from client_id to sub_client */
-    sub_set = ght_get(server.subscibe_table, chan_len, chan);
-    if (!sub_set) {
+    publish_ctx *ctx = (publish_ctx *) privdata;
+    worker *w = ctx->worker;
+    sub_client *sub_cli = (sub_client *) sub;
+    message *msg = ctx->msg;
+
+    if (!msg && !(msg = ctx->msg = msg_create_pub(ctx->topic, ctx->topic_len,
+                    ctx->payload, ctx->payload_len))) {
+        srv_log(LOG_ERROR, "failed to create message");
         return;
     }
-    for (sub_cli = hset_first(sub_set, &iter, &client_id);
-         sub_cli;
-         sub_cli = hset_next(sub_set, &iter, &client_id)) {
-        add_reply_bulk(sub_cli, msg);
+
+    /* subscribers of other workers are only touched by their owner */
+    if (sub_cli->worker == w) {
+        add_reply_msg(sub_cli, msg, chan, chan_len);
+    } else {
+        worker_deliver(w, sub_cli->worker, sub_cli, msg, chan_len);
+    }
+}
+
+/* Deliver payload to the subscribers of every channel which is a prefix of
+ * topic or equal to it and of every pattern matching it. Only the topic
+ * bytes are matched, hot topics hitting the match cache, and the payload is
+ * encoded once into a shared message on the first match and queued by
+ * reference. A message without a topic, NULL, is matched on its payload,
+ * the same as msg_topic does. */
+static void publish_message(pub_client *c, const char *topic,
+        size_t topic_len, const char *payload, size_t payload_len)
+{
+    publish_ctx ctx;
+
+    ctx.worker = c->worker;
+    ctx.msg = NULL;
+    ctx.topic = topic;
+    ctx.topic_len = topic ? topic_len : 0;
+    ctx.payload = payload;
+    ctx.payload_len = payload_len;
+
+    if (!topic) {
+        topic = payload;
+        topic_len = payload_len;
+    }
+    sub_index_match(c->worker->id, topic, topic_len, single_sub_publish,
+            &ctx);
+    if (ctx.msg) {
+        msg_decr_ref(ctx.msg);
+    }
+}
+
+/* Publish a message whose payload was read straight into it */
+static void publish_stream(pub_client *c, message *msg)
+{
+    publish_ctx ctx;
+    const char *topic;
+    size_t topic_len;
+
+    ctx.worker = c->worker;
+    ctx.msg = msg;
+    topic = msg_topic(msg, &topic_len);
+    sub_index_match(c->worker->id, topic, topic_len, single_sub_publish,
+            &ctx);
+    msg_decr_ref(msg);
+}
+
+/* Where the next bytes of the payload being streamed go */
+char *pub_cli_stream_buf(pub_client *c)
+{
+    return c->stream_msg->topic - c->stream_left;
+}
+
+/* Account for n bytes read at pub_cli_stream_buf, the message is published
+ * once the whole payload and its CRLF are in. */
+int pub_cli_stream_read(pub_client *c, size_t n)
+{
+    message *msg = c->stream_msg;
+
+    c->stream_left -= n;
+    if (c->stream_left) {
+        return PUBCLI_OK;
+    }
+    c->stream_msg = NULL;
+    if (msg->topic[-2] != '\r' || msg->topic[-1] != '\n') {
+        set_protocol_err(c, "expected CRLF after bulk message");
+        msg_decr_ref(msg);
+        return PUBCLI_ERR;
+    }
+    publish_stream(c, msg);
+    return PUBCLI_OK;
+}
+
+/* Start reading a payload of payload_len bytes starting at buf[*pos] into a
+ * message sized for it. What the read buffer holds of it is moved to the
+ * message, the rest is read straight into the message by pub_ev_handler, so
+ * a large payload is neither accumulated in nor copied out of the read
+ * buffer. A NULL topic publishes the payload on itself. */
+static int start_stream(pub_client *c, size_t *pos, const char *topic,
+        size_t topic_len, size_t payload_len)
+{
+    size_t n = sdslen(c->read_buf) - *pos;
+    message *msg;
+
+    if (!(msg = msg_create_pub(topic, topic_len, NULL, payload_len))) {
+        srv_log(LOG_ERROR, "failed to create message of %zu bytes",
+                payload_len);
+        return -1;
+    }
+    c->stream_msg = msg;
+    c->stream_left = payload_len + 2;
+    if (n > c->stream_left) {
+        n = c->stream_left;
+    }
+    memcpy(msg->payload, c->read_buf + *pos, n);
+    *pos += n;
+    return pub_cli_stream_read(c, n) == PUBCLI_OK ? 1 : -1;
+}
+
+/* Read a "<type><number>\r\n" line starting at buf[*pos], number being at
+ * most max.
+ *
+ * Returns 1 and advances *pos past the line when it is complete, 0 if more
+ * data is needed and -1 on protocol error. */
+static int read_len_line(pub_client *c, char type, size_t *pos,
+        long long max, long long *ll)
+{
+    char *buf = c->read_buf, *newline;
+    size_t len = sdslen(c->read_buf);
+
+    if (*pos >= len) {
+        return 0;
+    }
+    if (buf[*pos] != type) {
+        set_protocol_err(c, type == '$' ? "expected '$'" : "expected '*'");
+        return -1;
+    }
+
+    newline = (char *) scan_crlf(buf + *pos, len - *pos);
+    if (newline == NULL) {
+        if (len - *pos > MAX_INLINE_READ) {
+            set_protocol_err(c, "too big count string");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!string2ll(buf + *pos + 1, newline - (buf + *pos + 1), ll) ||
+            *ll < 0 || *ll > max) {
+        set_protocol_err(c, "invalid length");
+        return -1;
+    }
+
+    *pos = newline - buf + 2;
+    return 1;
+}
+
+/* Read the len bytes of a bulk string and their CRLF starting at buf[*pos],
+ * the header being already read. */
+static int read_bulk_data(pub_client *c, size_t *pos, size_t len, char **s)
+{
+    char *buf = c->read_buf;
+
+    if (sdslen(c->read_buf) - *pos < len + 2) {
+        return 0;
+    }
+    if (buf[*pos + len] != '\r' || buf[*pos + len + 1] != '\n') {
+        set_protocol_err(c, "expected CRLF after bulk string");
+        return -1;
+    }
+
+    *s = buf + *pos;
+    *pos += len + 2;
+    return 1;
+}
+
+/* Read a complete bulk string starting at buf[*pos], header included. */
+static int read_bulk(pub_client *c, size_t *pos, char **s, size_t *slen)
+{
+    size_t p = *pos;
+    long long ll;
+    int ret;
+
+    if ((ret = read_len_line(c, '$', &p, MAX_BULK_LEN, &ll)) != 1 ||
+        (ret = read_bulk_data(c, &p, ll, s)) != 1) {
+        return ret;
+    }
+
+    *slen = ll;
+    *pos = p;
+    return 1;
+}
+
+/* Process a "PUBLISH <topic> <payload>" multibulk request starting at
+ * buf[*pos]. Nothing is consumed until the whole request is in the buffer,
+ * unless the payload is large enough to be streamed. */
+static int process_publish_command(pub_client *c, size_t *pos)
+{
+    size_t p = *pos, name_len, topic_len, payload_len;
+    char *name, *topic, *payload;
+    long long ll;
+    int ret;
+
+    if ((ret = read_len_line(c, '*', &p, MAX_BULK_LEN, &ll)) != 1) {
+        return ret;
+    }
+    if (ll != 3) {
+        set_protocol_err(c, "PUBLISH expects a topic and a payload");
+        return -1;
+    }
+    if ((ret = read_bulk(c, &p, &name, &name_len)) != 1) {
+        return ret;
+    }
+    if (name_len != 7 || strncasecmp(name, "publish", 7) != 0) {
+        set_protocol_err(c, "unknown command");
+        return -1;
+    }
+    if ((ret = read_bulk(c, &p, &topic, &topic_len)) != 1) {
+        return ret;
+    }
+
+    /* the payload, read in place unless it is large */
+    if ((ret = read_len_line(c, '$', &p, server.max_msg_len, &ll)) != 1) {
+        return ret;
+    }
+    if (ll >= PUB_STREAM_MIN_LEN) {
+        if (start_stream(c, &p, topic, topic_len, ll) == -1) {
+            return -1;
+        }
+        *pos = p;
+        return 1;
+    }
+    if ((ret = read_bulk_data(c, &p, ll, &payload)) != 1) {
+        return ret;
     }
+    payload_len = ll;
+
+    publish_message(c, topic, topic_len, payload, payload_len);
+    *pos = p;
+    return 1;
 }
 
-void process_pub_read_buf(pub_client *c)
+/* Parse every complete message in the read buffer and publish it.
+ *
+ * A publisher can send three kinds of message, pipelined as it likes:
+ *   - PUBLISH as a RESP multibulk: "*3\r\n$7\r\nPUBLISH\r\n$<n>\r\n<topic>\r\n
+ *     $<len>\r\n<payload>\r\n", only the topic is matched against channels
+ *   - length prefixed: "$<len>\r\n<payload>\r\n", payload may be binary
+ *   - inline: "<payload>\n" (or "<payload>\r\n")
+ * The last two carry no topic, their payload itself is matched.
+ *
+ * A partial message is kept in the read buffer until the rest arrives and the
+ * buffer is trimmed only once per call. A payload of PUB_STREAM_MIN_LEN bytes
+ * or more is the exception, it is read straight into its message.
+ * */
+int process_pub_read_buf(pub_client *c)
 {
+    char *buf = c->read_buf, *newline;
     size_t len = sdslen(c->read_buf);
-    char *prefix = (char *) malloc(len + 1);
-    memcpy(prefix, c->read_buf, len + 1);
-
-    TrieState *s = trie_root(server.sub_trie);
-    AlphaChar *alpha = (AlphaChar *) malloc(sizeof(AlphaChar) * (len+1));
-    conv_to_alpha(server.dflt_to_alpha_conv, c->read_buf, alpha, len+1);
-    int last = -1, cur;
-    while ((cur = trie_walker(s, alpha, len, last + 1)) != -1) {
-        prefix[last+1] = c->read_buf[last+1];
-        prefix[cur+1] = '\0';
-        srv_log(LOG_DEBUG, "FOUND subscribe key: %s", prefix);
-        single_chan_publish(c->read_buf, prefix, cur+1);
-        last = cur;
-    }
-
-    free(alpha);
-    free(prefix);
-    trie_state_free(s);
-    sdsclear(c->read_buf);
+    size_t pos = 0, msg_len;
+    long long ll;
+    int ret;
+
+    /* a payload being streamed takes everything read until it ends */
+    while (pos < len && !c->stream_msg) {
+        if (c->bulk_len == -1) {
+            if (buf[pos] == '*') {
+                if ((ret = process_publish_command(c, &pos)) == -1) {
+                    return PUBCLI_ERR;
+                } else if (ret == 0) {
+                    break;
+                }
+                continue;
+            } else if (buf[pos] == '$') {
+                if ((ret = read_len_line(c, '$', &pos, server.max_msg_len,
+                                &ll)) == -1) {
+                    return PUBCLI_ERR;
+                } else if (ret == 0) {
+                    break;
+                }
+                if (ll >= PUB_STREAM_MIN_LEN) {
+                    if (start_stream(c, &pos, NULL, 0, ll) == -1) {
+                        return PUBCLI_ERR;
+                    }
+                    continue;
+                }
+                c->bulk_len = ll;
+            } else {
+                newline = (char *) scan_chr(buf + pos, len - pos, '\n');
+                if (newline == NULL) {
+                    if (len - pos > MAX_INLINE_READ) {
+                        set_protocol_err(c, "too big inline message");
+                        return PUBCLI_ERR;
+                    }
+                    break;
+                }
+
+                msg_len = newline - (buf + pos);
+                if (msg_len && *(newline-1) == '\r') {
+                    msg_len--;
+                }
+                if (msg_len) {
+                    publish_message(c, NULL, 0, buf + pos, msg_len);
+                }
+                pos = newline - buf + 1;
+                continue;
+            }
+        }
+
+        /* Read bulk message (+2 == trailing \r\n) */
+        if (len - pos < (size_t) c->bulk_len + 2) {
+            break;
+        }
+        if (buf[pos + c->bulk_len] != '\r' ||
+                buf[pos + c->bulk_len + 1] != '\n') {
+            set_protocol_err(c, "expected CRLF after bulk message");
+            return PUBCLI_ERR;
+        }
+        publish_message(c, NULL, 0, buf + pos, c->bulk_len);
+        pos += c->bulk_len + 2;
+        c->bulk_len = -1;
+    }
+
+    /* Trim to pos */
+    if (pos) sdsrange(c->read_buf, pos, -1);
+
+    return PUBCLI_OK;
 }
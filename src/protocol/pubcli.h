@@ -3,15 +3,29 @@
 
 #include "sds.h"
 
+struct worker;
+struct message;
+
 typedef struct pub_client {
     int fd;
     void *ev;
+    /* the worker which accepted this client */
+    struct worker *worker;
     sds read_buf;
     sds write_buf;
+
+    /* length of the bulk message being read, -1 if the header is unread */
+    int bulk_len;
+    /* a large payload is read straight into the message it is published
+     * as, stream_left bytes of it and of its CRLF being still unread */
+    struct message *stream_msg;
+    size_t stream_left;
 } pub_client;
 
 pub_client *pub_cli_create(int fd);
 void pub_cli_release(pub_client *c);
-void process_pub_read_buf(pub_client *c);
+int process_pub_read_buf(pub_client *c);
+char *pub_cli_stream_buf(pub_client *c);
+int pub_cli_stream_read(pub_client *c, size_t n);
 
 #endif
@@ -1,46 +1,107 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include <event2/event.h>
-#include <datrie/trie.h>
 
 #include "util.h"
 #include "subcli.h"
 #include "zmalloc.h"
 #include "broker.h"
 #include "event.h"
-#include "trie_util.h"
-#include "hset.h"
+#include "message.h"
+#include "worker.h"
+#include "subindex.h"
+#include "epoch.h"
+#include "trie.h"
+#include "scan.h"
 
-static void set_protocol_err(sub_client *c, int pos);
-static int process_multibulk_buffer(sub_client *c);
-static int process_inline_buffer(sub_client *c);
 static int process_command(sub_client *c);
 
 static void ping_command(sub_client *c);
 static void subscribe_command(sub_client *c);
 static void unsubscribe_command(sub_client *c);
+static void psubscribe_command(sub_client *c);
+static void punsubscribe_command(sub_client *c);
+static void esubscribe_command(sub_client *c);
+static void eunsubscribe_command(sub_client *c);
+static void subpolicy_command(sub_client *c);
+static void info_command(sub_client *c);
+
+static void unsubscribe_all(sub_client *c, int kind, const char *ack);
 
 static int prepare_to_write(sub_client *c);
-static void add_reply_bulklen(sub_client *c, sds cnt);
 static void add_reply(sub_client *c, sds cnt);
 static void add_reply_error_fmt(sub_client *c, const char *fmt, ...);
 static void add_reply_error_length(sub_client *c, char *s, size_t len);
 static void add_reply_string(sub_client *c, char *s, size_t len);
+static void add_reply_bulk(sub_client *c, char *s, size_t len);
+static void add_reply_sub_ack(sub_client *c, const char *kind,
+        const char *chan, size_t chan_len);
 
 /* Subscribe client command table
  *
- * name: a string representing the command name.
+ * name: a string representing the command name, matched case insensitively.
  * proc: pointer to the C function implementing the command.
  * arity: number of arguments, it is possible to use -N to say >= N
+ * flags: CMD_* flags, checked against server.denied_cmd_flags.
  * */
 struct sub_command sub_command_table[] = {
-    {"ping", ping_command, 1},
-    {"subscribe", subscribe_command, -2},
-    {"unsubscribe", unsubscribe_command, -1},
+    {"ping", ping_command, 1, CMD_READONLY},
+    {"subscribe", subscribe_command, -2, CMD_PUBSUB},
+    {"unsubscribe", unsubscribe_command, -1, CMD_PUBSUB},
+    {"psubscribe", psubscribe_command, -2, CMD_PUBSUB},
+    {"punsubscribe", punsubscribe_command, -1, CMD_PUBSUB},
+    {"esubscribe", esubscribe_command, -2, CMD_PUBSUB},
+    {"eunsubscribe", eunsubscribe_command, -1, CMD_PUBSUB},
+    {"subpolicy", subpolicy_command, -3, 0},
+    {"info", info_command, 1, CMD_READONLY|CMD_ADMIN},
+};
+
+/* The commands by the slot their name hashes to, command_seed being picked
+ * by sub_commands_init so that no two of them share a slot */
+#define CMD_SLOT_BITS   5
+#define CMD_SEED_TRIES  4096
+
+static sub_command *command_slots[1 << CMD_SLOT_BITS];
+static uint32_t command_seed;
+
+/* Slow consumer policies, the name is used in broker.conf and SUBPOLICY */
+typedef struct slow_policy_def {
+    char *name;
+    int policy;
+} slow_policy_def;
+
+static slow_policy_def slow_policy_table[] = {
+    {"disconnect", SLOW_POLICY_DISCONNECT},
+    {"drop-oldest", SLOW_POLICY_DROP_OLDEST},
+    {"conflate", SLOW_POLICY_CONFLATE},
 };
 
+static slow_policy_def *lookup_slow_policy(const char *name)
+{
+    int i;
+    int num = sizeof(slow_policy_table) / sizeof(slow_policy_def);
+    for (i = 0; i < num; i++) {
+        if (strcasecmp(name, slow_policy_table[i].name) == 0) {
+            return slow_policy_table + i;
+        }
+    }
+    return NULL;
+}
+
+/* Return the policy named name, or -1 if there is no such policy */
+int get_slow_policy(const char *name)
+{
+    slow_policy_def *def = lookup_slow_policy(name);
+    return def ? def->policy : -1;
+}
+
 sub_client *sub_cli_create(int fd, int inc_counter)
 {
     sub_client *c = (sub_client *) zmalloc(sizeof(sub_client));
@@ -48,263 +109,562 @@ sub_client *sub_cli_create(int fd, int inc_counter)
         return NULL;
     }
     c->fd = fd;
-    c->id = (char *) malloc(CLIENT_ID_LEN+1);
+    c->handle = 0;
     c->id[CLIENT_ID_LEN] = '\0';
     create_objectid(c->id, inc_counter);
-    c->ev = NULL;
+    c->flags = 0;
+    c->worker = NULL;
+    c->rev = NULL;
+    c->wev = NULL;
+    c->pending_prev = NULL;
+    c->pending_next = NULL;
     c->read_buf = sdsempty();
     c->wbufpos = 0;
+    c->wbufsent = 0;
+    c->reply = NULL;
+    c->reply_head = 0;
+    c->reply_count = 0;
+    c->reply_cap = 0;
+    c->reply_sentlen = 0;
+    c->reply_bytes = 0;
+    c->reply_seq = 0;
+    c->conflate_seqs = NULL;
+    c->channels = NULL;
+    c->patterns = NULL;
+    c->exact = NULL;
+    c->sub_policies = NULL;
+    c->soft_limit_reached_time = 0;
+    c->spilled_bytes = 0;
+    c->spill_lost = 0;
+    c->req_pos = 0;
+    c->parse_pos = 0;
+    c->req_type = 0;
     c->multi_bulk_len = 0;
     c->bulk_len = -1;
+    c->argc = 0;
+    c->argv_cap = 0;
+    c->argv = NULL;
     return c;
 }
 
-hashtable *sub_commands_init()
+/* Slot of the command named name, hashed from its length and its first and
+ * last letters, case folded */
+static uint32_t command_slot(const char *name, size_t len, uint32_t seed)
 {
-    hashtable *commands;
+    uint32_t key = ((uint32_t) ((unsigned char) name[0] | 0x20) << 16) |
+        ((uint32_t) ((unsigned char) name[len - 1] | 0x20) << 8) |
+        (uint32_t) (len & 0xff);
+
+    return (key * seed) >> (32 - CMD_SLOT_BITS);
+}
 
+/* Build a perfect hash of the command table: try seeds until every
+ * command gets a slot of its own */
+int sub_commands_init()
+{
     int num_cmds = sizeof(sub_command_table) / sizeof(sub_command);
-    commands = ght_create(3 * num_cmds);
-    int i;
-    for (i = 0; i < num_cmds; i++) {
-        sub_command *cmd = sub_command_table + i;
-        ght_insert(commands, cmd, strlen(cmd->name), cmd->name);
+    sub_command *cmd;
+    uint32_t seed, slot;
+    int i, tries;
+
+    for (seed = 0x9e3779b1, tries = 0; tries < CMD_SEED_TRIES;
+         seed += 2, tries++) {
+        memset(command_slots, 0, sizeof(command_slots));
+        for (i = 0; i < num_cmds; i++) {
+            cmd = sub_command_table + i;
+            slot = command_slot(cmd->name, strlen(cmd->name), seed);
+            if (command_slots[slot]) {
+                break;
+            }
+            command_slots[slot] = cmd;
+        }
+        if (i == num_cmds) {
+            command_seed = seed;
+            return SUBCLI_OK;
+        }
     }
-
-    return commands;
+    return SUBCLI_ERR;
 }
 
-static void free_client_argv(sub_client *c)
+/* The command named name, in any case, or NULL. One slot is probed and
+ * compared, nothing is allocated. */
+static sub_command *lookup_command(const char *name, size_t len)
 {
-    int i;
-    for (i = 0; i < c->argc; i++) {
-        srv_log(LOG_DEBUG, "freeing client argv: %s", c->argv[i]);
-        /*free(c->argv[i]);*/
-        sdsfree(c->argv[i]);
+    sub_command *cmd;
+
+    if (len == 0) {
+        return NULL;
     }
-    if (c->argc > 0) {
-        free(c->argv);
+    cmd = command_slots[command_slot(name, len, command_seed)];
+    if (cmd && strlen(cmd->name) == len &&
+            strncasecmp(cmd->name, name, len) == 0) {
+        return cmd;
     }
-    c->argc = 0;
+    return NULL;
 }
 
+/* Get ready to parse the next request */
 void reset_client(sub_client *c)
 {
-    free_client_argv(c);
+    c->argc = 0;
     c->req_type = 0;
     c->multi_bulk_len = 0;
     c->bulk_len = -1;
 }
 
+static void unlink_pending_write(sub_client *c)
+{
+    if (c->pending_prev) {
+        c->pending_prev->pending_next = c->pending_next;
+    } else {
+        c->worker->clients_pending_write = c->pending_next;
+    }
+    if (c->pending_next) {
+        c->pending_next->pending_prev = c->pending_prev;
+    }
+    c->pending_prev = c->pending_next = NULL;
+    c->flags &= ~SUBCLI_PENDING_WRITE;
+}
+
+static void free_sub_client(sub_client *c)
+{
+    sdsfree(c->read_buf);
+    zfree(c->argv);
+    while (c->reply_count) {
+        msg_decr_ref(c->reply[c->reply_head]);
+        c->reply_head = (c->reply_head + 1) % c->reply_cap;
+        c->reply_count--;
+    }
+    zfree(c->reply);
+    if (c->conflate_seqs) {
+        hmap_release(c->conflate_seqs);
+    }
+    if (c->sub_policies) {
+        hmap_release(c->sub_policies);
+    }
+    if (c->rev) {
+        event_free(c->rev);
+    }
+    if (c->wev) {
+        event_free(c->wev);
+    }
+    if (c->fd != -1) {
+        close(c->fd);
+    }
+    zfree(c);
+}
+
 void sub_cli_release(sub_client *c)
 {
     if (!c) {
         return;
     }
-    sdsfree(c->read_buf);
-    event_del((struct event *)(c->ev));
-    zfree(c);
+    worker_remove_client(c->worker, c);
+    if (c->flags & SUBCLI_CLOSE_ASAP) {
+        lkd_list_remove(c->worker->clients_to_close, c);
+    }
+    if (c->flags & SUBCLI_PENDING_WRITE) {
+        unlink_pending_write(c);
+    }
+
+    if (c->flags & SUBCLI_PUBSUB) {
+        /* Publishes of other workers which started before the client was
+         * unsubscribed may still find it, so it is only detached here and
+         * freed once they are done. The messages they hand over to it are
+         * dropped, its handle being released already. */
+        unsubscribe_all(c, SUB_KIND_PREFIX, NULL);
+        unsubscribe_all(c, SUB_KIND_PATTERN, NULL);
+        unsubscribe_all(c, SUB_KIND_EXACT, NULL);
+        sub_index_commit();
+        c->flags |= SUBCLI_CLOSE_ASAP;
+        event_del(c->rev);
+        event_del(c->wev);
+        close(c->fd);
+        c->fd = -1;
+        c->free_epoch = epoch_advance();
+        lkd_list_append(c->worker->clients_to_free, c);
+        return;
+    }
+    free_sub_client(c);
 }
 
-static void set_protocol_err(sub_client *c, int pos)
+/* Free the unsubscribed clients that no publish can reach any more */
+void free_unsubscribed_clients(worker *w)
 {
-    srv_log(LOG_DEBUG, "Protocol error from sub client");
-    sdsrange(c->read_buf, pos, -1);
+    sub_client *c;
+    unsigned long long epoch;
+
+    /* the list is in epoch order, and once an epoch has passed the older
+     * ones have too */
+    if ((c = lkd_list_tail(w->clients_to_free)) != NULL &&
+            epoch_passed(c->free_epoch)) {
+        epoch = c->free_epoch;
+    } else if ((c = lkd_list_head(w->clients_to_free)) != NULL &&
+            epoch_passed(c->free_epoch)) {
+        epoch = c->free_epoch;
+    } else {
+        return;
+    }
+
+    /* messages handed over to them meanwhile are dropped by their handle,
+     * which was released with them */
+    while ((c = lkd_list_head(w->clients_to_free)) != NULL &&
+            c->free_epoch <= epoch) {
+        lkd_list_pop(w->clients_to_free);
+        free_sub_client(c);
+    }
 }
 
-static int process_multibulk_buffer(sub_client *c)
+/* Schedule the client to be freed when the current event callbacks are done.
+ * Used where freeing it right away is unsafe, e.g. while a publish is still
+ * iterating the subscribers. */
+void sub_cli_release_async(sub_client *c)
 {
-    char *newline = NULL;
-    int pos = 0, ok;
-    long long ll;
+    if (c->flags & SUBCLI_CLOSE_ASAP) {
+        return;
+    }
+    c->flags |= SUBCLI_CLOSE_ASAP;
+    event_del(c->rev);
+    event_del(c->wev);
+    lkd_list_append(c->worker->clients_to_close, c);
+    event_active(c->worker->close_ev, 0, 0);
+}
 
-    if (c->multi_bulk_len == 0) {
-        /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->read_buf, '\r');
-        if (newline == NULL) {
-            if (sdslen(c->read_buf) > MAX_INLINE_READ) {
-                srv_log(LOG_ERROR, "protocol error: too big mbulk string");
-                set_protocol_err(c, 0);
-            }
-            return SUBCLI_ERR;
-        }
+void free_clients_to_close(evutil_socket_t fd, short event, void *args)
+{
+    worker *w = (worker *) args;
+    sub_client *c;
+    (void) fd;
+    (void) event;
+
+    while ((c = lkd_list_pop(w->clients_to_close)) != NULL) {
+        c->flags &= ~SUBCLI_CLOSE_ASAP;
+        sub_cli_release(c);
+    }
+}
 
-        /* Buffer should also contain \n */
-        if (newline-(c->read_buf) > ((signed)sdslen(c->read_buf)-2)) {
-            return SUBCLI_ERR;
-        }
+/* Reply a protocol error and close the client, whatever it sent after the
+ * error can not be made sense of */
+static void set_protocol_err(sub_client *c, const char *reason)
+{
+    sds err;
+
+    srv_log(LOG_ERROR, "[fd %d] protocol error from sub client: %s",
+            c->fd, reason);
+    err = sdscatprintf(sdsempty(), "-ERR Protocol error: %s\r\n", reason);
+    /* best effort, the connection is closed right after */
+    if (write(c->fd, err, sdslen(err)) == -1) {
+        srv_log(LOG_DEBUG, "[fd %d] failed to send error to sub client",
+                c->fd);
+    }
+    sdsfree(err);
+    sub_cli_release_async(c);
+}
+
+/* Append the argument read_buf[pos, pos + len) to the request */
+static int add_arg(sub_client *c, size_t pos, size_t len)
+{
+    sub_arg *argv;
+    int cap;
 
-        ok = string2ll(c->read_buf+1, newline-(c->read_buf+1), &ll);
-        if (!ok || ll > SUB_READ_BUF_LEN) {
-            srv_log(LOG_ERROR, "protocol error: invalid multibulk length");
-            set_protocol_err(c, pos);
+    if (c->argc == c->argv_cap) {
+        cap = c->argv_cap ? c->argv_cap * 2 : SUB_ARGV_LEN;
+        if ((argv = zrealloc(c->argv, cap * sizeof(sub_arg))) == NULL) {
             return SUBCLI_ERR;
         }
+        c->argv = argv;
+        c->argv_cap = cap;
+    }
+    c->argv[c->argc].off = pos - c->req_pos;
+    c->argv[c->argc].len = len;
+    c->argc++;
+    return SUBCLI_OK;
+}
 
-        pos = (newline - c->read_buf) + 2;
-        if (ll <= 0) {
-            sdsrange(c->read_buf, pos, -1);
-            return SUBCLI_OK;
-        }
+/* Argument i of the request being processed, NUL terminated */
+static char *cmd_arg(sub_client *c, int i)
+{
+    return c->read_buf + c->req_pos + c->argv[i].off;
+}
 
-        c->multi_bulk_len = ll;
-        c->argv = malloc(sizeof(sds) * c->multi_bulk_len);
+static int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
     }
+    return (ch | 0x20) - 'a' + 10;
+}
 
-    while (c->multi_bulk_len) {
-        /* Read bulk length if unknown */
-        if (c->bulk_len == -1) {
-            newline = strchr(c->read_buf + pos, '\r');
-            if (newline == NULL) {
-                if (sdslen(c->read_buf) > MAX_INLINE_READ) {
-                    srv_log(LOG_ERROR, "protocol error: too big bulk count string");
-                    set_protocol_err(c, 0);
-                    return SUBCLI_ERR;
-                }
-                break;
-            }
-
-            /* Buffer should also contain \n */
-            if (newline-(c->read_buf) > ((signed)sdslen(c->read_buf)-2)) {
-                break;
-            }
+/* Split the inline request read_buf[req_pos, req_pos + len) into arguments
+ * the way sdssplitargs does: blanks separate them, "double quotes" take
+ * escapes such as \n or \x41 and 'single quotes' take \'. Unquoting only
+ * shortens an argument, so each one is written back over its own bytes and
+ * NUL terminated, over the blank or the newline which follows it. Empty
+ * arguments are dropped. */
+static int split_inline_args(sub_client *c, size_t len)
+{
+    char *p = c->read_buf + c->req_pos, *end = p + len, *w, *start;
+    int inq, insq, done;
 
-            if (c->read_buf[pos] != '$') {
-                srv_log(LOG_ERROR, "Protocol error: expected '$', got '%c'",
-                        c->read_buf[pos]);
-                set_protocol_err(c, pos);
+    for (;;) {
+        while (p < end && isspace((unsigned char) *p)) {
+            p++;
+        }
+        if (p == end) {
+            return SUBCLI_OK;
+        }
+        start = w = p;
+        inq = insq = done = 0;
+        while (!done) {
+            if ((inq || insq) && p == end) {
+                /* unterminated quotes */
                 return SUBCLI_ERR;
             }
-
-            ok = string2ll(c->read_buf+pos+1, newline-(c->read_buf+pos+1), &ll);
-            if (!ok || ll < 0 || ll > MAX_BULK_LEN) {
-                srv_log(LOG_ERROR, "Protocol error: invalid bulk length");
-                set_protocol_err(c, pos);
-                return SUBCLI_ERR;
+            if (inq) {
+                if (*p == '\\' && end - p >= 4 && p[1] == 'x' &&
+                        isxdigit((unsigned char) p[2]) &&
+                        isxdigit((unsigned char) p[3])) {
+                    *w++ = (char) (hex_digit(p[2]) * 16 + hex_digit(p[3]));
+                    p += 4;
+                } else if (*p == '\\' && end - p >= 2) {
+                    switch (p[1]) {
+                    case 'n': *w++ = '\n'; break;
+                    case 'r': *w++ = '\r'; break;
+                    case 't': *w++ = '\t'; break;
+                    case 'b': *w++ = '\b'; break;
+                    case 'a': *w++ = '\a'; break;
+                    default: *w++ = p[1]; break;
+                    }
+                    p += 2;
+                } else if (*p == '"') {
+                    done = 1;
+                    p++;
+                } else {
+                    *w++ = *p++;
+                }
+            } else if (insq) {
+                if (*p == '\\' && end - p >= 2 && p[1] == '\'') {
+                    *w++ = '\'';
+                    p += 2;
+                } else if (*p == '\'') {
+                    done = 1;
+                    p++;
+                } else {
+                    *w++ = *p++;
+                }
+            } else if (p == end || isspace((unsigned char) *p)) {
+                break;
+            } else if (*p == '"') {
+                inq = 1;
+                p++;
+            } else if (*p == '\'') {
+                insq = 1;
+                p++;
+            } else {
+                *w++ = *p++;
             }
-
-            pos += newline - (c->read_buf + pos) + 2;
-            c->bulk_len = ll;
         }
-
-        /* Read bulk argument */
-        if (sdslen(c->read_buf) - pos < (unsigned)(c->bulk_len + 2)) {
-            /* Not enough data (+2 == trailing \r\n) */
-            break;
-        } else {
-            /*c->argv[c->argc++] = create_string_obj(c->read_buf+pos, c->bulk_len);*/
-            c->argv[c->argc++] = sdsnewlen(c->read_buf+pos, c->bulk_len);
-            pos += c->bulk_len + 2;
+        /* a closing quote must be followed by a blank or nothing at all */
+        if (done && p < end && !isspace((unsigned char) *p)) {
+            return SUBCLI_ERR;
+        }
+        /* w <= p, the terminator only overwrites consumed bytes */
+        *w = '\0';
+        if (p < end) {
+            p++;
+        }
+        if (w > start && add_arg(c, start - c->read_buf, w - start) !=
+                SUBCLI_OK) {
+            return SUBCLI_ERR;
         }
-        c->bulk_len = -1;
-        c->multi_bulk_len--;
     }
+}
 
-    /* Trim to pos */
-    if (pos) sdsrange(c->read_buf, pos, -1);
+/* Parse an inline request, a line of arguments. Returns 1 once the request
+ * is complete, 0 if more data is needed and -1 on protocol error. */
+static int parse_inline(sub_client *c)
+{
+    size_t len = sdslen(c->read_buf), line_len;
+    char *newline;
 
-    /* We're done when c->multibulk == 0 */
-    if (c->multi_bulk_len == 0) return SUBCLI_OK;
+    /* the part of the line already read has no newline */
+    newline = (char *) scan_chr(c->read_buf + c->parse_pos,
+            len - c->parse_pos, '\n');
+    if (newline == NULL) {
+        if (len - c->req_pos > SUB_READ_BUF_LEN) {
+            set_protocol_err(c, "too big inline request");
+            return -1;
+        }
+        c->parse_pos = len;
+        return 0;
+    }
 
-    /* Still not read to process the command */
-    return SUBCLI_ERR;
+    line_len = newline - (c->read_buf + c->req_pos);
+    if (line_len && *(newline - 1) == '\r') {
+        line_len--;
+    }
+    if (split_inline_args(c, line_len) != SUBCLI_OK) {
+        set_protocol_err(c, "unbalanced quotes in request");
+        return -1;
+    }
+    c->parse_pos = newline - c->read_buf + 1;
+    return 1;
 }
 
-static int process_inline_buffer(sub_client *c)
+/* Read the "<type><n>\r\n" line at parse_pos into *ll. Returns 1 if it is
+ * complete, 0 if more data is needed and -1 on protocol error. */
+static int read_len_line(sub_client *c, char type, long long max,
+        long long *ll)
 {
-    char *newline;
-    int argc, i;
-    sds *argv, aux;
-    size_t querylen;
+    char *buf = c->read_buf, *newline;
+    size_t len = sdslen(c->read_buf), pos = c->parse_pos;
 
-    newline = strchr(c->read_buf, '\n');
+    if (buf[pos] != type) {
+        set_protocol_err(c, type == '$' ? "expected '$'" : "expected '*'");
+        return -1;
+    }
 
+    newline = (char *) scan_crlf(buf + pos, len - pos);
     if (newline == NULL) {
-        if (sdslen(c->read_buf) > SUB_READ_BUF_LEN) {
-            srv_log(LOG_ERROR, "Protocol error: too big inline request");
-            set_protocol_err(c, 0);
+        if (len - pos > MAX_INLINE_READ) {
+            set_protocol_err(c, "too big count string");
+            return -1;
         }
-        return SUBCLI_ERR;
+        return 0;
     }
 
-    if (newline && newline != c->read_buf && *(newline-1) == '\r') {
-        newline--;
+    if (!string2ll(buf + pos + 1, newline - (buf + pos + 1), ll) ||
+            *ll > max || (type == '$' && *ll < 0)) {
+        set_protocol_err(c, type == '$' ? "invalid bulk length" :
+                "invalid multibulk length");
+        return -1;
     }
 
-    querylen = newline - (c->read_buf);
-    aux = sdsnewlen(c->read_buf, querylen);
-    argv = sdssplitargs(aux, &argc);
-    sdsfree(aux);
-    if (argv == NULL) {
-        set_protocol_err(c, 0);
-        return SUBCLI_ERR;
+    c->parse_pos = newline - buf + 2;
+    return 1;
+}
+
+/* Parse a multibulk request, "*<argc>\r\n" followed by argc bulk strings
+ * "$<len>\r\n<arg>\r\n". The arguments are recorded as slices of read_buf as
+ * they arrive, parsing resumes after the last complete one. Returns 1 once
+ * the request is complete, 0 if more data is needed and -1 on protocol
+ * error. */
+static int parse_multibulk(sub_client *c)
+{
+    size_t len = sdslen(c->read_buf);
+    long long ll;
+    int ret;
+
+    if (c->parse_pos == c->req_pos) {
+        if ((ret = read_len_line(c, '*', SUB_READ_BUF_LEN, &ll)) != 1) {
+            return ret;
+        }
+        if (ll <= 0) {
+            return 1;
+        }
+        c->multi_bulk_len = ll;
     }
 
-    sdsrange(c->read_buf, querylen+2, -1);
+    while (c->multi_bulk_len) {
+        if (c->bulk_len == -1) {
+            if (c->parse_pos == len) {
+                return 0;
+            }
+            if ((ret = read_len_line(c, '$', MAX_BULK_LEN, &ll)) != 1) {
+                return ret;
+            }
+            c->bulk_len = ll;
+        }
 
-    /*c->argv = (char **) malloc(sizeof(char *) * argc);*/
-    c->argv = (char **) malloc(sizeof(sds) * argc);
-    for (c->argc = 0, i = 0; i < argc; i++) {
-        if (sdslen(argv[i])) {
-            /*c->argv[c->argc] = strdup(argv[i]);*/
-            c->argv[c->argc] = sdsnewlen(argv[i], strlen(argv[i]));
-            c->argc++;
-        } else {
-            sdsfree(argv[i]);
+        /* Read bulk argument (+2 == trailing \r\n) */
+        if (len - c->parse_pos < (size_t) c->bulk_len + 2) {
+            return 0;
+        }
+        if (c->read_buf[c->parse_pos + c->bulk_len] != '\r' ||
+                c->read_buf[c->parse_pos + c->bulk_len + 1] != '\n') {
+            set_protocol_err(c, "expected CRLF after bulk string");
+            return -1;
         }
+        if (add_arg(c, c->parse_pos, c->bulk_len) != SUBCLI_OK) {
+            set_protocol_err(c, "out of memory");
+            return -1;
+        }
+        c->read_buf[c->parse_pos + c->bulk_len] = '\0';
+        c->parse_pos += c->bulk_len + 2;
+        c->bulk_len = -1;
+        c->multi_bulk_len--;
     }
-    zfree(argv);
-    return SUBCLI_OK;
+    return 1;
 }
 
+/* Run the request, returns the flags of the command run, 0 if none was */
 static int process_command(sub_client *c)
 {
-    srv_log(LOG_DEBUG, "c->argv[0]: %s", c->argv[0]);
-    sds name = sdsnew(c->argv[0]);
-    sdstolower(name);
+    char *name = cmd_arg(c, 0);
+    sub_command *cmd = lookup_command(name, c->argv[0].len);
 
-    sub_command *cmd = ght_get(server.sub_commands, sdslen(name), name);
+    srv_log(LOG_DEBUG, "c->argv[0]: %s", name);
     if (!cmd) {
         add_reply_error_fmt(c, "unknown command '%s'", name);
+    } else if (cmd->flags & server.denied_cmd_flags) {
+        add_reply_error_fmt(c, "'%s' command is disabled", cmd->name);
     } else if ((cmd->arity > 0 && cmd->arity != c->argc) ||
                (c->argc < -cmd->arity)) {
         add_reply_error_fmt(c, "wrong number of arguments for '%s' command",
-                name);
+                cmd->name);
     } else {
         srv_log(LOG_DEBUG, "cmd name: %s arity: %d", cmd->name, cmd->arity);
         cmd->proc(c);
+        return cmd->flags;
     }
 
-    sdsfree(name);
-
-    return SUBCLI_OK;
+    return 0;
 }
 
+/* Parse and run every complete request in the read buffer.
+ *
+ * A request is parsed in place: its arguments are slices of read_buf, and
+ * a partial request is resumed where it was left when more data arrives.
+ * The buffer is only trimmed once per call, nothing is allocated per
+ * request or argument.
+ * */
 void process_sub_read_buf(sub_client *c)
 {
-    while (sdslen(c->read_buf)) {
-        if (c->read_buf[0] == '*') {
-            c->req_type = REQ_MULTIBULK;
-        } else {
-            c->req_type = REQ_INLINE;
-        }
+    int ret, flags = 0;
 
-        if (c->req_type == REQ_INLINE) {
-            if (process_inline_buffer(c) != SUBCLI_OK) break;
-        } else if (c->req_type == REQ_MULTIBULK) {
-            if (process_multibulk_buffer(c) != SUBCLI_OK) break;
+    while (c->parse_pos < sdslen(c->read_buf) &&
+            !(c->flags & SUBCLI_CLOSE_ASAP)) {
+        if (!c->req_type) {
+            c->req_type = c->read_buf[c->req_pos] == '*' ?
+                REQ_MULTIBULK : REQ_INLINE;
+        }
+        if (c->req_type == REQ_MULTIBULK) {
+            ret = parse_multibulk(c);
         } else {
-            srv_log(LOG_ERROR, "error req_type %d", c->req_type);
-            exit(EXIT_FAILURE);
+            ret = parse_inline(c);
+        }
+        if (ret != 1) {
+            break;
+        }
+        if (c->argc) {
+            flags |= process_command(c);
         }
+        c->req_pos = c->parse_pos;
+        reset_client(c);
     }
 
-    if (c->argc == 0) {
-        free_client_argv(c);
-    } else {
-        if (process_command(c) == SUBCLI_OK) {
-            reset_client(c);
-        }
+    /* Trim to the request still being parsed */
+    if (c->req_pos == sdslen(c->read_buf)) {
+        sdsclear(c->read_buf);
+    } else if (c->req_pos) {
+        sdsrange(c->read_buf, c->req_pos, -1);
+    }
+    c->parse_pos -= c->req_pos;
+    c->req_pos = 0;
+
+    /* subscriptions changed by the commands become visible at once */
+    if (flags & CMD_PUBSUB) {
+        sub_index_commit();
     }
 }
 
@@ -313,90 +673,316 @@ static void ping_command(sub_client *c)
     add_reply(c, shared.pong);
 }
 
-static int subscribe_channel(sub_client *c, sds channel)
+/* The subscriptions of c of the given kind */
+static hmap **sub_table(sub_client *c, int kind)
 {
-    TrieData data;
-    size_t len;
-    AlphaChar *chan_alpha;
+    if (kind == SUB_KIND_PATTERN) {
+        return &c->patterns;
+    }
+    return kind == SUB_KIND_EXACT ? &c->exact : &c->channels;
+}
 
-    len = sdslen(channel);
-    chan_alpha  = (AlphaChar *) malloc(sizeof(AlphaChar) * len + 1);
+static int subscribe_channel(sub_client *c, int kind, const char *channel,
+        size_t len)
+{
+    hmap **table = sub_table(c, kind);
+    sds chan;
 
-    conv_to_alpha(server.dflt_to_alpha_conv, channel, chan_alpha, len+1);
-    /* channel not exists in trie, create */
-    if (!trie_retrieve(server.sub_trie, chan_alpha, &data)) {
-        if (!trie_store(server.sub_trie, chan_alpha, TRIE_DATA_DFLT)) {
-            srv_log(LOG_ERROR, "Failed to insert key %s into sub trie", channel);
-            return SUBCLI_ERR;
-        }
-        /* create hashtable mapping from subscribe-channel to client id set */
-        hset *hs = hset_create(SUB_SET_LEN);
-        hset_insert(hs, CLIENT_ID_LEN, c->id, c);
-        if (ght_insert(server.subscibe_table, hs, len, channel) == -1) {
-            hset_release(hs);
-            srv_log(LOG_ERROR,
-                    "Failed to insert key[%s]->set into subscribe hashtable",
-                    channel);
-            return SUBCLI_ERR;
-        }
+    /* the key of every entry is its value */
+    if (!*table &&
+            (*table = hmap_create(SUB_SET_LEN, HMAP_BORROW_KEYS)) == NULL) {
+        return SUBCLI_ERR;
+    }
+    if (hmap_get(*table, channel, len)) {
+        return SUBCLI_OK;
+    }
+    if ((chan = sdsnewlen(channel, len)) == NULL ||
+            hmap_insert(*table, chan, sdslen(chan), chan) != HMAP_OK) {
+        sdsfree(chan);
+        return SUBCLI_ERR;
+    }
+    if (sub_index_add(kind, chan, sdslen(chan), c) != SUBINDEX_OK) {
+        srv_log(LOG_ERROR, "Failed to subscribe key %s", channel);
+        hmap_remove(*table, chan, sdslen(chan));
+        sdsfree(chan);
+        return SUBCLI_ERR;
     }
+    return SUBCLI_OK;
+}
 
+static int unsubscribe_channel(sub_client *c, int kind, const char *channel,
+        size_t len)
+{
+    hmap *table = *sub_table(c, kind);
+    sds chan;
+
+    if (!table) {
+        return SUBCLI_ERR;
+    }
+    chan = hmap_remove(table, channel, len);
+    if (!chan) {
+        return SUBCLI_ERR;
+    }
+    if (sub_index_del(kind, chan, sdslen(chan), c) != SUBINDEX_OK) {
+        srv_log(LOG_ERROR, "Failed to unsubscribe key %s", chan);
+    }
+    sdsfree(chan);
     return SUBCLI_OK;
 }
 
-static void subscribe_command(sub_client *c)
+/* Number of channels and patterns c is subscribed to */
+static int subscription_count(sub_client *c)
+{
+    return (c->channels ? hmap_size(c->channels) : 0) +
+        (c->patterns ? hmap_size(c->patterns) : 0) +
+        (c->exact ? hmap_size(c->exact) : 0);
+}
+
+/* Unsubscribe c from all its subscriptions of the given kind, in time
+ * proportional to their number. If ack is not NULL every one of them is
+ * confirmed to the client with it. */
+static void unsubscribe_all(sub_client *c, int kind, const char *ack)
+{
+    hmap **table = sub_table(c, kind);
+    hmap_iterator iter;
+    sds chan;
+
+    if (!*table || hmap_size(*table) == 0) {
+        if (ack) {
+            add_reply_sub_ack(c, ack, NULL, 0);
+        }
+        return;
+    }
+    for (chan = hmap_first(*table, &iter, NULL, NULL);
+         chan;
+         chan = hmap_next(*table, &iter, NULL, NULL)) {
+        if (sub_index_del(kind, chan, sdslen(chan), c) != SUBINDEX_OK) {
+            srv_log(LOG_ERROR, "Failed to unsubscribe key %s", chan);
+        }
+        if (ack) {
+            /* the count in the reply is the number left */
+            hmap_remove(*table, chan, sdslen(chan));
+            add_reply_sub_ack(c, ack, chan, sdslen(chan));
+        }
+        sdsfree(chan);
+    }
+    hmap_release(*table);
+    *table = NULL;
+}
+
+static void subscribe_generic(sub_client *c, int kind, const char *ack)
 {
     int i;
     for (i = 1; i < c->argc; i++) {
-        subscribe_channel(c, c->argv[i]);
+        if (subscribe_channel(c, kind, cmd_arg(c, i), c->argv[i].len) ==
+                SUBCLI_OK) {
+            c->flags |= SUBCLI_PUBSUB;
+            add_reply_sub_ack(c, ack, cmd_arg(c, i), c->argv[i].len);
+        } else {
+            add_reply_error_fmt(c, "failed to %s '%s'", ack, cmd_arg(c, i));
+        }
     }
-    add_reply_string(c, "+subscribe", 10);
-    add_reply_string(c, "\r\n", 2);
 }
 
+static void unsubscribe_generic(sub_client *c, int kind, const char *ack)
+{
+    int i;
+
+    if (c->argc == 1) {
+        unsubscribe_all(c, kind, ack);
+    } else {
+        for (i = 1; i < c->argc; i++) {
+            unsubscribe_channel(c, kind, cmd_arg(c, i), c->argv[i].len);
+            add_reply_sub_ack(c, ack, cmd_arg(c, i), c->argv[i].len);
+        }
+    }
+}
+
+/* SUBSCRIBE channel [channel ...]
+ *
+ * Every channel is confirmed with the array [subscribe, channel, count],
+ * count being the number of channels and patterns the client is subscribed
+ * to. */
+static void subscribe_command(sub_client *c)
+{
+    subscribe_generic(c, SUB_KIND_PREFIX, "subscribe");
+}
+
+/* UNSUBSCRIBE [channel ...]
+ *
+ * Unsubscribe from the given channels, or from all of them if none is
+ * given, confirmed like SUBSCRIBE. Messages published before may still be
+ * delivered. */
 static void unsubscribe_command(sub_client *c)
 {
-    add_reply_string(c, "+unsubscribe", 12);
-    add_reply_string(c, "\r\n", 2);
+    unsubscribe_generic(c, SUB_KIND_PREFIX, "unsubscribe");
 }
 
-int subcli_event_update(sub_client *c, short event)
+/* PSUBSCRIBE pattern [pattern ...]
+ *
+ * Subscribe to the topics made of segments separated by '.' matching the
+ * patterns, where a "*" segment matches any one segment and a last ">"
+ * segment one or more, e.g. "md.*.AAPL" or "md.>". Confirmed like
+ * SUBSCRIBE. */
+static void psubscribe_command(sub_client *c)
 {
-    event_del(c->ev);
+    subscribe_generic(c, SUB_KIND_PATTERN, "psubscribe");
+}
 
-    struct event *sub_ev_new = event_new(server.evloop, c->fd, event,
-            sub_ev_handler, c);
-    if (sub_ev_new == NULL) {
-        free(c);
-        close(c->fd);
-        srv_log(LOG_ERROR, "update sub client failed");
-        return SUBCLI_ERR;
+/* PUNSUBSCRIBE [pattern ...] */
+static void punsubscribe_command(sub_client *c)
+{
+    unsubscribe_generic(c, SUB_KIND_PATTERN, "punsubscribe");
+}
+
+/* ESUBSCRIBE channel [channel ...]
+ *
+ * Subscribe to the topics equal to the channels, rather than starting with
+ * them. A publish finds them with a single hash lookup. Confirmed like
+ * SUBSCRIBE. */
+static void esubscribe_command(sub_client *c)
+{
+    subscribe_generic(c, SUB_KIND_EXACT, "esubscribe");
+}
+
+/* EUNSUBSCRIBE [channel ...] */
+static void eunsubscribe_command(sub_client *c)
+{
+    unsubscribe_generic(c, SUB_KIND_EXACT, "eunsubscribe");
+}
+
+/* SUBPOLICY <policy> <channel|pattern> [channel|pattern ...]
+ *
+ * Set the slow consumer policy used for messages delivered through the given
+ * subscriptions of this client. */
+static void subpolicy_command(sub_client *c)
+{
+    slow_policy_def *def;
+    int i;
+
+    def = lookup_slow_policy(cmd_arg(c, 1));
+    if (!def) {
+        add_reply_error_fmt(c, "unknown slow consumer policy '%s'",
+                cmd_arg(c, 1));
+        return;
     }
-    if (event_add(sub_ev_new, NULL) == -1) {
-        event_del(sub_ev_new);
-        return SUBCLI_ERR;
+
+    if (!c->sub_policies &&
+            (c->sub_policies = hmap_create(SUB_SET_LEN, 0)) == NULL) {
+        add_reply_error_fmt(c, "out of memory");
+        return;
+    }
+    for (i = 2; i < c->argc; i++) {
+        if (hmap_replace(c->sub_policies, cmd_arg(c, i), c->argv[i].len,
+                    def) != HMAP_OK) {
+            add_reply_error_fmt(c, "out of memory");
+            return;
+        }
+    }
+    add_reply(c, shared.ok);
+}
+
+static void info_command(sub_client *c)
+{
+    long long hits, misses;
+    sds info;
+
+    sub_index_cache_stats(&hits, &misses);
+    info = sdscatprintf(sdsempty(),
+            "# Slow consumers\r\n"
+            "slow_consumer_policy:%s\r\n"
+            "slow_consumer_disconnected:%lld\r\n"
+            "slow_consumer_dropped:%lld\r\n"
+            "slow_consumer_conflated:%lld\r\n"
+            "\r\n"
+            "# Match cache\r\n"
+            "match_cache_size:%d\r\n"
+            "match_cache_hits:%lld\r\n"
+            "match_cache_misses:%lld\r\n",
+            slow_policy_table[server.slow_policy].name,
+            atomic_get(&server.stat_slow_disconnected),
+            atomic_get(&server.stat_slow_dropped),
+            atomic_get(&server.stat_slow_conflated),
+            server.match_cache_size, hits, misses);
+    add_reply_bulk(c, info, sdslen(info));
+    sdsfree(info);
+}
+
+/* Drop the first nwritten bytes of pending output, wbuf first and then the
+ * queued messages in order. */
+static void consume_reply(sub_client *c, size_t nwritten)
+{
+    size_t n;
+    message *m;
+
+    if (c->wbufpos > c->wbufsent) {
+        n = c->wbufpos - c->wbufsent;
+        if (nwritten < n) {
+            c->wbufsent += nwritten;
+            return;
+        }
+        c->wbufpos = c->wbufsent = 0;
+        nwritten -= n;
+    }
+
+    while (c->reply_count) {
+        m = c->reply[c->reply_head];
+        n = m->len - c->reply_sentlen;
+        if (nwritten < n) {
+            c->reply_sentlen += nwritten;
+            return;
+        }
+        nwritten -= n;
+        c->reply_sentlen = 0;
+        c->reply_bytes -= m->len;
+        msg_decr_ref(m);
+        c->reply_head = (c->reply_head + 1) % c->reply_cap;
+        c->reply_count--;
+        c->reply_seq++;
+    }
+
+    if (c->conflate_seqs) {
+        hmap_release(c->conflate_seqs);
+        c->conflate_seqs = NULL;
     }
-    c->ev = sub_ev_new;
-    return SUBCLI_OK;
 }
 
 void send_reply_to_subcli(sub_client *c)
 {
-    int nwritelen, sentlen = 0;
+    struct iovec iov[SUB_WRITE_IOV_MAX];
+    int iovcnt, i;
+    ssize_t nwritten = 0;
+    message *m;
+
+    while (c->wbufpos > 0 || c->reply_count > 0) {
+        iovcnt = 0;
+        if (c->wbufpos > c->wbufsent) {
+            iov[iovcnt].iov_base = c->wbuf + c->wbufsent;
+            iov[iovcnt].iov_len = c->wbufpos - c->wbufsent;
+            iovcnt++;
+        }
+        for (i = 0; i < c->reply_count && iovcnt < SUB_WRITE_IOV_MAX; i++) {
+            m = c->reply[(c->reply_head + i) % c->reply_cap];
+            iov[iovcnt].iov_base = m->data + (i == 0 ? c->reply_sentlen : 0);
+            iov[iovcnt].iov_len = m->len - (i == 0 ? c->reply_sentlen : 0);
+            iovcnt++;
+        }
 
-    while (c->wbufpos > 0) {
-        nwritelen = write(c->fd, c->wbuf+sentlen, c->wbufpos-sentlen);
-        if (nwritelen <= 0) {
+        nwritten = writev(c->fd, iov, iovcnt);
+        if (nwritten <= 0) {
             break;
         }
-        sentlen += nwritelen;
-        if (sentlen == c->wbufpos) {
-            c->wbufpos = 0;
-        }
+        consume_reply(c, nwritten);
     }
 
-    if (nwritelen == -1) {
+    if (nwritten == -1) {
         if (errno == EAGAIN) {
+            /* socket is full, wait until it is writable again */
+            if (!event_pending(c->wev, EV_WRITE, NULL) &&
+                    event_add(c->wev, NULL) == -1) {
+                srv_log(LOG_ERROR, "[fd %d] failed to add write event", c->fd);
+                sub_cli_release(c);
+            }
             return;
         } else {
             srv_log(LOG_ERROR, "Error writing to client: %s", strerror(errno));
@@ -404,44 +990,369 @@ void send_reply_to_subcli(sub_client *c)
             return;
         }
     }
-    subcli_event_update(c, event_get_events(c->ev) & ~EV_WRITE);
+    if (event_pending(c->wev, EV_WRITE, NULL)) {
+        event_del(c->wev);
+    }
+}
+
+/* Write out the clients which got new output during this loop iteration.
+ * Runs as the last callback of the iteration, so all the replies of a read
+ * or a publish burst go out with one write per client. */
+void flush_clients_pending_write(evutil_socket_t fd, short event, void *args)
+{
+    worker *w = (worker *) args;
+    sub_client *c;
+    (void) fd;
+    (void) event;
+
+    while ((c = w->clients_pending_write) != NULL) {
+        unlink_pending_write(c);
+        if (c->flags & SUBCLI_CLOSE_ASAP) {
+            continue;
+        }
+        send_reply_to_subcli(c);
+    }
 }
 
 static int prepare_to_write(sub_client *c)
 {
-    short event = event_get_events(c->ev);
-    if (!(event & EV_WRITE)) {
-        return subcli_event_update(c, event | EV_WRITE);
+    if (c->flags & SUBCLI_CLOSE_ASAP) {
+        return SUBCLI_ERR;
+    }
+
+    /* If the socket is known to be full the write event takes care of it,
+     * otherwise the client is written directly before the loop goes back to
+     * wait for events. */
+    if (!(c->flags & SUBCLI_PENDING_WRITE) &&
+            !event_pending(c->wev, EV_WRITE, NULL)) {
+        c->flags |= SUBCLI_PENDING_WRITE;
+        c->pending_prev = NULL;
+        c->pending_next = c->worker->clients_pending_write;
+        if (c->pending_next) {
+            c->pending_next->pending_prev = c;
+        } else {
+            event_active(c->worker->flush_ev, 0, 0);
+        }
+        c->worker->clients_pending_write = c;
     }
     return SUBCLI_OK;
 }
 
-void add_reply_bulk(sub_client *c, sds cnt)
+static obuf_limit *get_output_limit(sub_client *c)
+{
+    return &server.obuf_limits[(c->flags & SUBCLI_PUBSUB) ?
+        SUBCLI_CLASS_PUBSUB : SUBCLI_CLASS_NORMAL];
+}
+
+/* Size of the queued output of the client, the slot of every queued message
+ * counts as well so that the limits bound the length of the queue */
+static size_t output_size(sub_client *c)
 {
-    add_reply_bulklen(c, cnt);
-    add_reply(c, cnt);
-    add_reply(c, shared.crlf);
+    return c->reply_bytes + c->reply_count * sizeof(message *);
 }
 
-static void add_reply_bulklen(sub_client *c, sds cnt)
+/* Return 1 if the queued output of the client has reached the hard limit of
+ * its class, or has stayed over the soft limit for too long. */
+static int check_output_limits(sub_client *c)
 {
-    size_t len = sdslen(cnt);
-    sds lensds = sdscatprintf(sdsempty(), "$%lu\r\n", len);
-    add_reply(c, lensds);
+    obuf_limit *limit = get_output_limit(c);
+    size_t size = output_size(c);
+    int now;
+
+    if (limit->hard_limit && size >= limit->hard_limit) {
+        return 1;
+    }
+
+    if (limit->soft_limit && size >= limit->soft_limit) {
+        get_time_sec(&now);
+        if (c->soft_limit_reached_time == 0) {
+            c->soft_limit_reached_time = now;
+        } else if (now - c->soft_limit_reached_time >= limit->soft_seconds) {
+            return 1;
+        }
+    } else {
+        c->soft_limit_reached_time = 0;
+    }
+    return 0;
 }
 
-static int add_reply_to_buf(sub_client *c, char *s, size_t len)
+/* A client is behind once its queued output is over the soft limit, or over
+ * half the hard limit if its class has no soft limit. */
+static size_t behind_threshold(sub_client *c)
 {
-    size_t available = sizeof(c->wbuf) - c->wbufpos;
-    if (len > available) {
+    obuf_limit *limit = get_output_limit(c);
+    return limit->soft_limit ? limit->soft_limit : limit->hard_limit / 2;
+}
+
+static int is_behind(sub_client *c)
+{
+    size_t threshold = behind_threshold(c);
+    return threshold && output_size(c) >= threshold;
+}
+
+/* The policy for msg delivered through the channel chan, or through some
+ * pattern of c matching it if chan is NULL */
+static int get_sub_policy(sub_client *c, message *msg, const char *chan,
+        size_t chan_len)
+{
+    slow_policy_def *def = NULL;
+    hmap_iterator iter;
+    const char *topic;
+    size_t topic_len;
+    sds pattern;
+
+    if (!c->sub_policies) {
+        return server.slow_policy;
+    }
+    if (chan) {
+        def = hmap_get(c->sub_policies, chan, chan_len);
+    } else if (c->patterns) {
+        topic = msg_topic(msg, &topic_len);
+        for (pattern = hmap_first(c->patterns, &iter, NULL, NULL);
+             pattern && !def;
+             pattern = hmap_next(c->patterns, &iter, NULL, NULL)) {
+            if (seg_match(pattern, sdslen(pattern), topic, topic_len)) {
+                def = hmap_get(c->sub_policies, pattern, sdslen(pattern));
+            }
+        }
+    }
+    return def ? def->policy : server.slow_policy;
+}
+
+/* Append a reference to msg to the queue, the message is shared with every
+ * other client it is delivered to. */
+static int push_reply(sub_client *c, message *msg)
+{
+    message **reply;
+    int i, cap;
+
+    if (c->reply_count == c->reply_cap) {
+        if (c->reply_cap > INT_MAX / 2) {
+            return SUBCLI_ERR;
+        }
+        cap = c->reply_cap ? c->reply_cap * 2 : SUB_REPLY_INIT_LEN;
+        reply = (message **) zmalloc(sizeof(message *) * cap);
+        if (!reply) {
+            return SUBCLI_ERR;
+        }
+        for (i = 0; i < c->reply_count; i++) {
+            reply[i] = c->reply[(c->reply_head + i) % c->reply_cap];
+        }
+        zfree(c->reply);
+        c->reply = reply;
+        c->reply_head = 0;
+        c->reply_cap = cap;
+    }
+
+    msg_incr_ref(msg);
+    c->reply[(c->reply_head + c->reply_count) % c->reply_cap] = msg;
+    c->reply_count++;
+    c->reply_bytes += msg->len;
+    return SUBCLI_OK;
+}
+
+/* Drop the oldest published messages until the client is no longer behind.
+ * Command replies and a partially sent message are kept. */
+static void drop_oldest_replies(sub_client *c)
+{
+    size_t target = behind_threshold(c);
+    size_t size = output_size(c);
+    message **slot;
+    message *m;
+    int i, j, w;
+
+    for (i = (c->reply_sentlen ? 1 : 0);
+         i < c->reply_count && size >= target;
+         i++) {
+        slot = &c->reply[(c->reply_head + i) % c->reply_cap];
+        if ((*slot)->flags & MSG_PUBLISHED) {
+            size -= (*slot)->len + sizeof(message *);
+            c->reply_bytes -= (*slot)->len;
+            msg_decr_ref(*slot);
+            *slot = NULL;
+            atomic_incr(&server.stat_slow_dropped, 1);
+        }
+    }
+
+    /* The kept slots before i are moved up next to slot i and the head
+     * moves past the dropped ones, so that the slots from i on keep their
+     * sequence numbers for conflate_reply. */
+    w = i;
+    for (j = i - 1; j >= 0; j--) {
+        m = c->reply[(c->reply_head + j) % c->reply_cap];
+        if (m) {
+            w--;
+            c->reply[(c->reply_head + w) % c->reply_cap] = m;
+        }
+    }
+    c->reply_head = (c->reply_head + w) % c->reply_cap;
+    c->reply_count -= w;
+    c->reply_seq += w;
+    c->soft_limit_reached_time = 0;
+}
+
+/* Replace the queued message of the same topic with msg, if any. Returns
+ * SUBCLI_OK when msg took its place, SUBCLI_ERR when msg should be queued. */
+static int conflate_reply(sub_client *c, message *msg)
+{
+    message **slot;
+    long long seq;
+    void *val;
+
+    if (!(msg->flags & MSG_HAS_TOPIC)) {
+        return SUBCLI_ERR;
+    }
+    if (!c->conflate_seqs &&
+            (c->conflate_seqs = hmap_create(SUB_SET_LEN, 0)) == NULL) {
         return SUBCLI_ERR;
     }
 
-    memcpy(c->wbuf + c->wbufpos, s, len);
-    c->wbufpos += len;
+    /* sequence numbers are stored off by one, NULL means not found */
+    val = hmap_get(c->conflate_seqs, msg->topic, msg->topic_len);
+    if (val) {
+        seq = (long long) (intptr_t) val - 1;
+        if (seq >= c->reply_seq && seq < c->reply_seq + c->reply_count &&
+                !(seq == c->reply_seq && c->reply_sentlen)) {
+            slot = &c->reply[(c->reply_head + (seq - c->reply_seq)) %
+                c->reply_cap];
+            if (((*slot)->flags & MSG_HAS_TOPIC) &&
+                    (*slot)->topic_len == msg->topic_len &&
+                    memcmp((*slot)->topic, msg->topic, msg->topic_len) == 0) {
+                c->reply_bytes -= (*slot)->len;
+                msg_decr_ref(*slot);
+                msg_incr_ref(msg);
+                *slot = msg;
+                c->reply_bytes += msg->len;
+                atomic_incr(&server.stat_slow_conflated, 1);
+                return SUBCLI_OK;
+            }
+        }
+    }
+
+    if (push_reply(c, msg) != SUBCLI_OK) {
+        return SUBCLI_OK;
+    }
+    seq = c->reply_seq + c->reply_count - 1;
+    val = (void *) (intptr_t) (seq + 1);
+    if (hmap_replace(c->conflate_seqs, msg->topic, msg->topic_len, val)
+            != HMAP_OK) {
+        /* a stale sequence number would let a later message of the topic
+         * replace one queued before msg, the topic is rather not conflated
+         * until the next message of it is recorded */
+        srv_log(LOG_ERROR, "failed to record conflated topic");
+        hmap_remove(c->conflate_seqs, msg->topic, msg->topic_len);
+    }
     return SUBCLI_OK;
 }
 
+/* Called once the output limits are reached, see check_output_limits */
+static void handle_slow_consumer(sub_client *c, int policy)
+{
+    if (policy == SLOW_POLICY_DISCONNECT) {
+        srv_log(LOG_WARN, "[fd %d] closing sub client %s for overcoming "
+                "output buffer limits, %zu bytes queued", c->fd, c->id,
+                output_size(c));
+        atomic_incr(&server.stat_slow_disconnected, 1);
+        sub_cli_release_async(c);
+    } else {
+        drop_oldest_replies(c);
+    }
+}
+
+/* Queue a published message which is delivered through the subscription of
+ * chan. When the client is behind the slow consumer policy of the
+ * subscription decides what happens to it. */
+void add_reply_msg(sub_client *c, message *msg, const char *chan,
+        size_t chan_len)
+{
+    int policy = -1;
+
+    if (prepare_to_write(c) == SUBCLI_ERR) {
+        return;
+    }
+
+    /* the policy is only looked up for clients which are behind */
+    if (is_behind(c)) {
+        policy = get_sub_policy(c, msg, chan, chan_len);
+    }
+
+    if (policy == SLOW_POLICY_CONFLATE) {
+        conflate_reply(c, msg);
+    } else if (push_reply(c, msg) != SUBCLI_OK) {
+        srv_log(LOG_ERROR, "failed to queue message to sub client");
+        return;
+    }
+
+    if (check_output_limits(c)) {
+        if (policy == -1) {
+            policy = get_sub_policy(c, msg, chan, chan_len);
+        }
+        handle_slow_consumer(c, policy);
+    }
+}
+
+/* Called with the first of the deliveries to c which other workers
+ * dropped once their spilled deliveries to it reached the hard output
+ * limit, see worker_deliver(). The slow consumer policy of the subscription
+ * msg was delivered through decides what happens to c. */
+void handle_lost_deliveries(sub_client *c, message *msg, const char *chan,
+        size_t chan_len)
+{
+    long long lost = __atomic_exchange_n(&c->spill_lost, 0, __ATOMIC_SEQ_CST);
+
+    if (get_sub_policy(c, msg, chan, chan_len) == SLOW_POLICY_DISCONNECT) {
+        srv_log(LOG_WARN, "[fd %d] closing sub client %s for overcoming "
+                "output buffer limits, %lld messages held back were lost",
+                c->fd, c->id, lost);
+        atomic_incr(&server.stat_slow_disconnected, 1);
+        sub_cli_release_async(c);
+    } else {
+        atomic_incr(&server.stat_slow_dropped, lost);
+    }
+}
+
+static int add_reply_to_buf(sub_client *c, const char *s, size_t len)
+{
+    message *msg;
+    int ret;
+
+    /* Once messages are queued, wbuf can't be used any more without
+     * reordering the output, so the reply is queued as well. */
+    if (c->reply_count == 0) {
+        size_t available = sizeof(c->wbuf) - c->wbufpos;
+        if (len <= available) {
+            memcpy(c->wbuf + c->wbufpos, s, len);
+            c->wbufpos += len;
+            return SUBCLI_OK;
+        }
+    }
+
+    /* Replies following each other share a chunk, so that the replies to
+     * a pipeline take a few slots rather than one each */
+    msg = c->reply_count ?
+        c->reply[(c->reply_head + c->reply_count - 1) % c->reply_cap] : NULL;
+    if (msg && !(msg->flags & MSG_PUBLISHED) && msg->cap - msg->len >= len) {
+        memcpy(msg->data + msg->len, s, len);
+        msg->len += len;
+        c->reply_bytes += len;
+        ret = SUBCLI_OK;
+    } else {
+        msg = msg_create_reply(len > SUB_REPLY_CHUNK_LEN ?
+                len : SUB_REPLY_CHUNK_LEN);
+        if (!msg) {
+            return SUBCLI_ERR;
+        }
+        memcpy(msg->data, s, len);
+        msg->len = len;
+        ret = push_reply(c, msg);
+        msg_decr_ref(msg);
+    }
+    if (ret == SUBCLI_OK && check_output_limits(c)) {
+        handle_slow_consumer(c, SLOW_POLICY_DISCONNECT);
+    }
+    return ret;
+}
+
 static void add_reply(sub_client *c, sds cnt)
 {
     if (prepare_to_write(c) == SUBCLI_ERR) {
@@ -488,3 +1399,41 @@ static void add_reply_string(sub_client *c, char *s, size_t len)
     add_reply_to_buf(c, s, len);
 }
 
+
+static void add_reply_bulk(sub_client *c, char *s, size_t len)
+{
+    char hdr[SIZE32];
+    int hdrlen = snprintf(hdr, sizeof(hdr), "$%zu\r\n", len);
+
+    add_reply_string(c, hdr, hdrlen);
+    add_reply_string(c, s, len);
+    add_reply_string(c, "\r\n", 2);
+}
+
+/* Confirm a subscription change on chan, NULL if there is none, as the
+ * array [kind, chan, count]. Nothing is allocated, the channel is copied
+ * straight from the request. */
+static void add_reply_sub_ack(sub_client *c, const char *kind,
+        const char *chan, size_t chan_len)
+{
+    char hdr[SIZE64], tail[SIZE32];
+    int hdrlen, taillen;
+
+    if (prepare_to_write(c) == SUBCLI_ERR) {
+        return;
+    }
+    if (chan) {
+        hdrlen = snprintf(hdr, sizeof(hdr), "*3\r\n$%zu\r\n%s\r\n$%zu\r\n",
+                strlen(kind), kind, chan_len);
+    } else {
+        hdrlen = snprintf(hdr, sizeof(hdr), "*3\r\n$%zu\r\n%s\r\n$-1\r\n",
+                strlen(kind), kind);
+    }
+    taillen = snprintf(tail, sizeof(tail), "%s:%d\r\n", chan ? "\r\n" : "",
+            subscription_count(c));
+    add_reply_to_buf(c, hdr, hdrlen);
+    if (chan) {
+        add_reply_to_buf(c, chan, chan_len);
+    }
+    add_reply_to_buf(c, tail, taillen);
+}
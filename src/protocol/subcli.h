@@ -2,54 +2,139 @@
 #define __SUBCLI_H
 
 #include <event2/event_struct.h>
+#include <event2/util.h>
 
 #include "sds.h"
-#include "ght_hash_table.h"
+#include "hmap.h"
 #include "constant.h"
+#include "message.h"
+#include "worker.h"
 
 #define REQ_INLINE      1
 #define REQ_MULTIBULK   2
 
+/* sub client flags */
+#define SUBCLI_PUBSUB       (1<<0)  /* client has subscribed some channel */
+#define SUBCLI_CLOSE_ASAP   (1<<1)  /* client is queued to be closed */
+#define SUBCLI_PENDING_WRITE (1<<2) /* client is in clients_pending_write */
+
+/* an argument of the request being parsed, a slice of read_buf starting off
+ * bytes after the request */
+typedef struct sub_arg {
+    size_t off;
+    size_t len;
+} sub_arg;
+
 typedef struct sub_client {
     /* socket fd*/
     int fd;
 
-    /* a 12-byte value likes MongoDB ObjectId */
-    char *id;
+    /* handle of the client in its worker, what other workers know it by */
+    client_handle handle;
+    /* a 12-byte value likes MongoDB ObjectId, only used in logs */
+    char id[CLIENT_ID_LEN + 1];
     INT64 expire_time;
 
-    /* pointer to registered event of this client */
-    struct event *ev;
+    int flags;
+    /* epoch at which the client was unsubscribed before being freed */
+    unsigned long long free_epoch;
+
+    /* persistent read and write events of this client, the write event is
+     * only added while there is pending output */
+    struct event *rev;
+    struct event *wev;
+
+    /* the worker which accepted this client, only its thread touches the
+     * client */
+    struct worker *worker;
+
+    /* links in worker->clients_pending_write */
+    struct sub_client *pending_prev;
+    struct sub_client *pending_next;
 
     sds read_buf;
 
+    /* small replies are copied into wbuf, bytes [wbufsent, wbufpos) are
+     * still to be sent */
     int wbufpos;
+    int wbufsent;
     char wbuf[SUB_WRITE_BUF_LEN];
 
+    /* messages queued by reference after wbuf, a ring of reply_cap slots */
+    message **reply;
+    int reply_head;
+    int reply_count;
+    int reply_cap;
+    /* bytes of the first queued message already sent */
+    size_t reply_sentlen;
+    /* total bytes of the queued messages */
+    size_t reply_bytes;
+    /* sequence number of the message at reply_head */
+    long long reply_seq;
+    /* mapping from topic to the sequence number of its latest queued
+     * message, kept while conflating */
+    hmap *conflate_seqs;
+    /* mapping from channel to itself as an sds, the channels this client
+     * is subscribed to */
+    hmap *channels;
+    /* the patterns this client is subscribed to, likewise */
+    hmap *patterns;
+    /* the channels this client is subscribed to exactly, likewise */
+    hmap *exact;
+    /* mapping from channel to its slow consumer policy, for the
+     * subscriptions which do not use the default one */
+    hmap *sub_policies;
+    /* when the soft output limit was first exceeded, 0 if it is not */
+    int soft_limit_reached_time;
+    /* bytes of the deliveries to this client spilled by other workers and
+     * not queued yet, and the number of deliveries they dropped since those
+     * reached the hard output limit, both updated atomically by them */
+    size_t spilled_bytes;
+    long long spill_lost;
+
+    /* the request being parsed starts at read_buf[req_pos], parsing
+     * resumes at read_buf[parse_pos] */
+    size_t req_pos;
+    size_t parse_pos;
     int req_type;
+    /* bulk strings of the request still to read */
     int multi_bulk_len;
     int bulk_len;
 
-    /* client command argc and argv */
+    /* arguments of the request, the array is kept for the next ones */
     int argc;
-    sds *argv;
+    int argv_cap;
+    sub_arg *argv;
 } sub_client;
 
 typedef void sub_command_proc(sub_client *c);
 
+/* sub command flags */
+#define CMD_READONLY    (1<<0)  /* changes nothing */
+#define CMD_PUBSUB      (1<<1)  /* changes the subscriptions of the client */
+#define CMD_ADMIN       (1<<2)  /* reports on the broker, may be disabled */
+
 typedef struct sub_command {
     char *name;
     sub_command_proc *proc;
     int arity;
+    int flags;
 } sub_command;
 
 sub_client *sub_cli_create(int fd, int inc_counter);
-hashtable *sub_commands_init();
+int sub_commands_init();
 void reset_client(sub_client *c);
 void sub_cli_release(sub_client *c);
+void sub_cli_release_async(sub_client *c);
+void free_clients_to_close(evutil_socket_t fd, short event, void *args);
+void free_unsubscribed_clients(struct worker *w);
+void flush_clients_pending_write(evutil_socket_t fd, short event, void *args);
 void process_sub_read_buf(sub_client *c);
-int subcli_event_update(sub_client *c, short event);
 void send_reply_to_subcli(sub_client *c);
-void add_reply_bulk(sub_client *c, sds cnt);
+void add_reply_msg(sub_client *c, message *msg, const char *chan,
+        size_t chan_len);
+void handle_lost_deliveries(sub_client *c, message *msg, const char *chan,
+        size_t chan_len);
+int get_slow_policy(const char *name);
 
 #endif
@@ -0,0 +1,1098 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "subindex.h"
+#include "epoch.h"
+#include "trie.h"
+#include "subset.h"
+#include "hmap.h"
+#include "constant.h"
+#include "zmalloc.h"
+
+/* a shard per first byte for the prefix channels and patterns, one for the
+ * patterns starting with a wildcard segment which may match any topic, then
+ * the shards of the exact channels, picked by the hash of the channel */
+#define WILD_SHARD          256
+#define EXACT_SHARD_BITS    12
+#define EXACT_SHARD_FIRST   (WILD_SHARD + 1)
+#define SUB_INDEX_SHARDS    (EXACT_SHARD_FIRST + (1 << EXACT_SHARD_BITS))
+
+/* topics longer than this, or matching more subscribers, are not cached so
+ * that a cache stays small */
+#define MATCH_CACHE_MAX_TOPIC   SIZE256
+#define MATCH_CACHE_MAX_RCPTS   SIZE1024
+
+typedef struct shard_snap {
+    /* the prefix channels of the shard, each one mapped to the set of its
+     * subscribers */
+    trie trie;
+    /* the patterns of the shard, mapped likewise */
+    seg_trie patterns;
+    /* the exact channels of the shard, mapped likewise, NULL if there is
+     * none */
+    hmap *exact;
+    /* the changes of a draft are made under txn, which records what they
+     * replaced in the snapshot the draft started from */
+    trie_txn txn;
+} shard_snap;
+
+typedef struct shard {
+    /* serializes the writers of the shard */
+    pthread_mutex_t lock;
+    /* current snapshot, NULL while the shard is empty */
+    shard_snap *snap;
+    /* next version of snap holding the changes not committed yet, NULL if
+     * there is none */
+    shard_snap *draft;
+} shard;
+
+/* A subscriber matched by a topic, through the channel made of its first
+ * chan_len bytes, or through a pattern if chan_len is 0 */
+typedef struct cache_rcpt {
+    void *sub;
+    size_t chan_len;
+} cache_rcpt;
+
+/* The subscribers topic matched as of generation gen */
+typedef struct cache_entry {
+    /* 0 while the entry is free */
+    unsigned long long gen;
+    char *topic;
+    size_t topic_len;
+    size_t topic_cap;
+    cache_rcpt *rcpts;
+    int count;
+    int cap;
+} cache_entry;
+
+/* The recent match results of a reader, only used by that reader. An entry
+ * is picked by the hash of its topic and replaced on collision. */
+typedef struct match_cache {
+    /* NULL if the cache is disabled */
+    cache_entry *entries;
+    size_t mask;
+    long long hits;
+    long long misses;
+} match_cache;
+
+static shard shards[SUB_INDEX_SHARDS];
+/* bit i is set while shards[i] has a draft */
+static uint64_t drafted[(SUB_INDEX_SHARDS + 63) / 64];
+/* bumped by every commit of a shard, after its snapshot is published, a
+ * cached result is stale once it differs */
+static unsigned long long generation = 1;
+/* number of exact channels in the published snapshots, updated before a
+ * snapshot is published so that a topic is only looked up when some exact
+ * channel may be equal to it */
+static size_t exact_channels;
+static match_cache *caches;
+static int ncaches;
+
+/* The shard of the exact channel of hash hmap_hash(chan, len) */
+static shard *exact_shard(uint64_t hash)
+{
+    return &shards[EXACT_SHARD_FIRST + (hash >> (64 - EXACT_SHARD_BITS))];
+}
+
+static shard *get_shard(int kind, const char *s, size_t len)
+{
+    if (kind == SUB_KIND_EXACT) {
+        return exact_shard(hmap_hash(s, len));
+    }
+    if (kind == SUB_KIND_PATTERN &&
+            (s[0] == SEG_TRIE_ONE || s[0] == SEG_TRIE_REST) &&
+            (len == 1 || s[1] == SEG_TRIE_SEP)) {
+        return &shards[WILD_SHARD];
+    }
+    return &shards[(unsigned char) s[0]];
+}
+
+static void subs_free(void *ptr)
+{
+    subset_release((subset *) ptr);
+}
+
+static void release_subs(const char *chan, size_t chan_len, void *subs,
+        void *privdata)
+{
+    (void) chan;
+    (void) chan_len;
+    (void) privdata;
+    subset_release((subset *) subs);
+}
+
+/* Call proc for every exact channel of table */
+static void exact_walk(hmap *table, trie_walk_proc *proc, void *privdata)
+{
+    hmap_iterator iter;
+    const void *key;
+    size_t len;
+    void *subs;
+
+    for (subs = hmap_first(table, &iter, &key, &len);
+         subs;
+         subs = hmap_next(table, &iter, &key, &len)) {
+        proc((const char *) key, len, subs, privdata);
+    }
+}
+
+/* Free snap with everything it holds, which no other snapshot shares */
+static void snap_free(void *ptr)
+{
+    shard_snap *snap = (shard_snap *) ptr;
+
+    trie_walk(&snap->trie, release_subs, NULL);
+    trie_clear(&snap->trie, NULL);
+    if (snap->exact) {
+        exact_walk(snap->exact, release_subs, NULL);
+        hmap_release(snap->exact);
+    }
+    seg_trie_walk(&snap->patterns, release_subs, NULL);
+    seg_trie_clear(&snap->patterns, NULL);
+    zfree(snap);
+}
+
+/* Free snap once its draft was published, with what the draft replaced in
+ * it. The rest of its channels and sets belong to the draft. */
+static void snap_retire(void *ptr)
+{
+    shard_snap *snap = (shard_snap *) ptr;
+
+    trie_txn_free_garbage(&snap->txn);
+    if (snap->exact) {
+        hmap_release(snap->exact);
+    }
+    zfree(snap);
+}
+
+/* A draft sharing the channels and sets of old, which may be NULL, but its
+ * table of exact channels which is copied */
+static shard_snap *snap_fork(shard_snap *old)
+{
+    shard_snap *snap = (shard_snap *) zmalloc(sizeof(shard_snap));
+    if (!snap) {
+        return NULL;
+    }
+    if (old) {
+        snap->trie = old->trie;
+        snap->patterns = old->patterns;
+        snap->exact = NULL;
+        if (old->exact && (snap->exact = hmap_dup(old->exact)) == NULL) {
+            zfree(snap);
+            return NULL;
+        }
+    } else {
+        trie_init(&snap->trie);
+        seg_trie_init(&snap->patterns);
+        snap->exact = NULL;
+    }
+    trie_txn_begin(&snap->txn);
+    return snap;
+}
+
+/* Number of channels and patterns in snap */
+static size_t snap_size(shard_snap *snap)
+{
+    return trie_size(&snap->trie) +
+        (snap->exact ? hmap_size(snap->exact) : 0) +
+        seg_trie_size(&snap->patterns);
+}
+
+/* The subscriber set of chan in snap, or NULL */
+static subset *snap_get_subs(shard_snap *snap, int kind, const char *chan,
+        size_t chan_len)
+{
+    void *subs;
+    int ret;
+
+    if (kind == SUB_KIND_EXACT) {
+        return snap->exact ? hmap_get(snap->exact, chan, chan_len) : NULL;
+    } else if (kind == SUB_KIND_PATTERN) {
+        ret = seg_trie_find(&snap->patterns, chan, chan_len, &subs);
+    } else {
+        ret = trie_find(&snap->trie, chan, chan_len, &subs);
+    }
+    return ret == TRIE_OK ? (subset *) subs : NULL;
+}
+
+/* Map chan to the subscriber set subs in the draft snap, whether it is
+ * there or not */
+static int snap_insert(shard_snap *snap, int kind, const char *chan,
+        size_t chan_len, subset *subs)
+{
+    if (kind == SUB_KIND_EXACT) {
+        if (!snap->exact &&
+                (snap->exact = hmap_create(SUB_SET_LEN, 0)) == NULL) {
+            return TRIE_ERR;
+        }
+        return hmap_replace(snap->exact, chan, chan_len, subs) == HMAP_OK ?
+            TRIE_OK : TRIE_ERR;
+    } else if (kind == SUB_KIND_PATTERN) {
+        return seg_trie_insert(&snap->patterns, chan, chan_len, subs,
+                &snap->txn);
+    }
+    return trie_insert(&snap->trie, chan, chan_len, subs, &snap->txn);
+}
+
+/* Add chan with an empty subscriber set to the draft snap */
+static subset *snap_add_channel(shard_snap *snap, int kind, const char *chan,
+        size_t chan_len)
+{
+    subset *subs = subset_create();
+
+    if (!subs) {
+        return NULL;
+    }
+    subs->edit = snap->txn.id;
+    if (snap_insert(snap, kind, chan, chan_len, subs) != TRIE_OK) {
+        subset_release(subs);
+        return NULL;
+    }
+    return subs;
+}
+
+/* The subscriber set subs of chan in the draft snap, replaced by a copy
+ * first if it is shared with the snapshot the draft started from */
+static subset *snap_own_subs(shard_snap *snap, int kind, const char *chan,
+        size_t chan_len, subset *subs)
+{
+    subset *copy;
+
+    if (subs->edit == snap->txn.id) {
+        return subs;
+    }
+    if ((copy = subset_dup(subs)) == NULL) {
+        return NULL;
+    }
+    copy->edit = snap->txn.id;
+    if (snap_insert(snap, kind, chan, chan_len, copy) != TRIE_OK) {
+        subset_release(copy);
+        return NULL;
+    }
+    trie_txn_retire(&snap->txn, subs, subs_free);
+    return copy;
+}
+
+/* Drop chan and its subscriber set from the draft snap. The channel is
+ * left with an empty set if it cannot be removed. */
+static void snap_del_channel(shard_snap *snap, int kind, const char *chan,
+        size_t chan_len, subset *subs)
+{
+    if (kind == SUB_KIND_EXACT) {
+        hmap_remove(snap->exact, chan, chan_len);
+        if (hmap_size(snap->exact) == 0) {
+            hmap_release(snap->exact);
+            snap->exact = NULL;
+        }
+    } else if (kind == SUB_KIND_PATTERN) {
+        if (seg_trie_delete(&snap->patterns, chan, chan_len, &snap->txn) !=
+                TRIE_OK) {
+            return;
+        }
+        if (seg_trie_size(&snap->patterns) == 0) {
+            seg_trie_clear(&snap->patterns, &snap->txn);
+        }
+    } else {
+        if (trie_delete(&snap->trie, chan, chan_len, &snap->txn) != TRIE_OK) {
+            return;
+        }
+        if (trie_size(&snap->trie) == 0) {
+            trie_clear(&snap->trie, &snap->txn);
+        }
+    }
+    if (subs->edit == snap->txn.id) {
+        subset_release(subs);
+    } else {
+        trie_txn_retire(&snap->txn, subs, subs_free);
+    }
+}
+
+/* The draft of s, started from its snapshot if needed. Called with the
+ * lock of s. */
+static shard_snap *shard_draft(shard *s)
+{
+    shard_snap *draft;
+    size_t i = s - shards;
+
+    if (s->draft) {
+        return s->draft;
+    }
+    if ((draft = snap_fork(s->snap)) == NULL) {
+        return NULL;
+    }
+    __atomic_store_n(&s->draft, draft, __ATOMIC_SEQ_CST);
+    __atomic_or_fetch(&drafted[i / 64], 1ULL << (i % 64), __ATOMIC_SEQ_CST);
+    return draft;
+}
+
+/* Publish the draft of s in place of its snapshot. The old snapshot is
+ * freed once no reader uses it, along with what the draft replaced in it.
+ * Called with the lock of s. */
+static void shard_commit(shard *s)
+{
+    shard_snap *old = s->snap, *snap = s->draft;
+    trie_txn txn = snap->txn;
+    size_t i = s - shards;
+
+    /* added before the old count is taken off, so that the count never
+     * drops below the channels of either snapshot */
+    if (snap->exact) {
+        __atomic_add_fetch(&exact_channels, hmap_size(snap->exact),
+                __ATOMIC_SEQ_CST);
+    }
+    if (old && old->exact) {
+        __atomic_sub_fetch(&exact_channels, hmap_size(old->exact),
+                __ATOMIC_SEQ_CST);
+    }
+    snap->txn.garbage = NULL;
+    snap->txn.ngarbage = 0;
+    snap->txn.cap = 0;
+    if (snap_size(snap) == 0) {
+        /* what is left of it may still be shared with old */
+        trie_txn_retire(&txn, snap, snap_free);
+        snap = NULL;
+    }
+    __atomic_store_n(&s->snap, snap, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->txn = txn;
+        epoch_retire(old, snap_retire);
+    } else {
+        trie_txn_free_garbage(&txn);
+    }
+    /* published before the draft is cleared, so that a thread seeing no
+     * draft knows the changes are visible, and the cached results are
+     * stale from then on */
+    __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->draft, NULL, __ATOMIC_SEQ_CST);
+    __atomic_and_fetch(&drafted[i / 64], ~(1ULL << (i % 64)),
+            __ATOMIC_SEQ_CST);
+}
+
+/* nreaders is the number of threads which may match topics concurrently,
+ * each one caching the results of up to cache_size topics, rounded up to a
+ * power of two. A cache_size of 0 disables the caches. */
+int sub_index_init(int nreaders, size_t cache_size)
+{
+    size_t size = 1;
+    int i;
+
+    if (epoch_init(nreaders) != EPOCH_OK) {
+        return SUBINDEX_ERR;
+    }
+    for (i = 0; i < SUB_INDEX_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].snap = NULL;
+        shards[i].draft = NULL;
+    }
+    memset(drafted, 0, sizeof(drafted));
+
+    if ((caches = zcalloc(nreaders * sizeof(match_cache))) == NULL) {
+        sub_index_free();
+        return SUBINDEX_ERR;
+    }
+    ncaches = nreaders;
+    while (size < cache_size) {
+        size <<= 1;
+    }
+    for (i = 0; cache_size && i < nreaders; i++) {
+        caches[i].entries = zcalloc(size * sizeof(cache_entry));
+        caches[i].mask = size - 1;
+        if (!caches[i].entries) {
+            sub_index_free();
+            return SUBINDEX_ERR;
+        }
+    }
+    return SUBINDEX_OK;
+}
+
+void sub_index_free()
+{
+    size_t j;
+    int i;
+
+    for (i = 0; i < ncaches; i++) {
+        for (j = 0; caches[i].entries && j <= caches[i].mask; j++) {
+            zfree(caches[i].entries[j].topic);
+            zfree(caches[i].entries[j].rcpts);
+        }
+        zfree(caches[i].entries);
+    }
+    zfree(caches);
+    caches = NULL;
+    ncaches = 0;
+
+    for (i = 0; i < SUB_INDEX_SHARDS; i++) {
+        /* a draft shares most of the snapshot */
+        if (shards[i].draft) {
+            shard_commit(&shards[i]);
+        }
+        if (shards[i].snap) {
+            snap_free(shards[i].snap);
+            shards[i].snap = NULL;
+        }
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    exact_channels = 0;
+    epoch_finalize();
+}
+
+/* Subscribe sub to chan of the given kind. The subscription is seen by
+ * readers after the next sub_index_commit(). */
+int sub_index_add(int kind, const char *chan, size_t chan_len, void *sub)
+{
+    shard *s;
+    shard_snap *snap;
+    subset *subs;
+
+    if (chan_len == 0) {
+        return SUBINDEX_ERR;
+    }
+    s = get_shard(kind, chan, chan_len);
+
+    pthread_mutex_lock(&s->lock);
+    snap = s->draft ? s->draft : s->snap;
+    if (snap) {
+        subs = snap_get_subs(snap, kind, chan, chan_len);
+        if (subs && subset_has(subs, sub)) {
+            pthread_mutex_unlock(&s->lock);
+            return SUBINDEX_OK;
+        }
+    }
+
+    if ((snap = shard_draft(s)) == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+    subs = snap_get_subs(snap, kind, chan, chan_len);
+    subs = subs ? snap_own_subs(snap, kind, chan, chan_len, subs) :
+        snap_add_channel(snap, kind, chan, chan_len);
+    if (!subs) {
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+    if (subset_add(subs, sub) != SUBSET_OK) {
+        if (subs->size == 0) {
+            snap_del_channel(snap, kind, chan, chan_len, subs);
+        }
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return SUBINDEX_OK;
+}
+
+/* Unsubscribe sub from chan, the channel is dropped with its last
+ * subscriber. Returns SUBINDEX_ERR if sub is not subscribed to chan or the
+ * shard could not be changed. Readers see the change after the next
+ * sub_index_commit(), and those which started before that may still find
+ * the subscriber, see epoch_advance(). */
+int sub_index_del(int kind, const char *chan, size_t chan_len, void *sub)
+{
+    shard *s;
+    shard_snap *snap;
+    subset *subs;
+
+    if (chan_len == 0) {
+        return SUBINDEX_ERR;
+    }
+    s = get_shard(kind, chan, chan_len);
+
+    pthread_mutex_lock(&s->lock);
+    snap = s->draft ? s->draft : s->snap;
+    if (!snap || (subs = snap_get_subs(snap, kind, chan, chan_len)) == NULL ||
+            !subset_has(subs, sub)) {
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+
+    if ((snap = shard_draft(s)) == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+    subs = snap_get_subs(snap, kind, chan, chan_len);
+    if (subs->size == 1) {
+        /* the set goes with its last subscriber, no need to copy it */
+        snap_del_channel(snap, kind, chan, chan_len, subs);
+    } else if ((subs = snap_own_subs(snap, kind, chan, chan_len, subs))
+            != NULL) {
+        subset_remove(subs, sub);
+    } else {
+        pthread_mutex_unlock(&s->lock);
+        return SUBINDEX_ERR;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return SUBINDEX_OK;
+}
+
+/* Make the changes of all threads since the last commit seen by readers.
+ * A change only copies the path to its channel and the set it changes, the
+ * first time in a batch, and they are all published at once. */
+void sub_index_commit()
+{
+    shard *s;
+    uint64_t bits;
+    size_t w;
+    int committed = 0;
+
+    for (w = 0; w < sizeof(drafted) / sizeof(drafted[0]); w++) {
+        bits = __atomic_load_n(&drafted[w], __ATOMIC_SEQ_CST);
+        for (; bits; bits &= bits - 1) {
+            s = &shards[w * 64 + __builtin_ctzll(bits)];
+            pthread_mutex_lock(&s->lock);
+            if (s->draft) {
+                shard_commit(s);
+                committed++;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    if (committed) {
+        epoch_reclaim();
+    }
+}
+
+typedef struct match_ctx {
+    int kind;
+    sub_index_proc *proc;
+    void *privdata;
+    /* the cache entry recording the result, NULL if it is not cached */
+    cache_entry *entry;
+} match_ctx;
+
+/* Make e the entry of topic as of gen, with no subscriber yet */
+static int cache_entry_reset(cache_entry *e, const char *topic,
+        size_t topic_len, unsigned long long gen)
+{
+    char *buf;
+
+    e->gen = 0;
+    e->count = 0;
+    if (topic_len > e->topic_cap) {
+        if ((buf = zrealloc(e->topic, topic_len)) == NULL) {
+            return SUBINDEX_ERR;
+        }
+        e->topic = buf;
+        e->topic_cap = topic_len;
+    }
+    memcpy(e->topic, topic, topic_len);
+    e->topic_len = topic_len;
+    e->gen = gen;
+    return SUBINDEX_OK;
+}
+
+/* Record a subscriber in the entry of ctx, which is dropped if it grows
+ * too large */
+static void cache_entry_add(match_ctx *ctx, void *sub, size_t chan_len)
+{
+    cache_entry *e = ctx->entry;
+    cache_rcpt *rcpts;
+    int cap;
+
+    if (e->count == e->cap) {
+        cap = e->cap ? e->cap * 2 : SIZE4;
+        if (cap > MATCH_CACHE_MAX_RCPTS ||
+                (rcpts = zrealloc(e->rcpts, cap * sizeof(cache_rcpt)))
+                == NULL) {
+            e->gen = 0;
+            ctx->entry = NULL;
+            return;
+        }
+        e->rcpts = rcpts;
+        e->cap = cap;
+    }
+    e->rcpts[e->count].sub = sub;
+    e->rcpts[e->count].chan_len = chan_len;
+    e->count++;
+}
+
+static void match_sub(const char *chan, size_t chan_len, void *ptr,
+        void *privdata)
+{
+    match_ctx *ctx = (match_ctx *) privdata;
+    subset *subs = (subset *) ptr;
+    uint32_t i;
+
+    /* patterns do not outlive the snapshot */
+    if (ctx->kind == SUB_KIND_PATTERN) {
+        chan = NULL;
+        chan_len = 0;
+    }
+    for (i = 0; i < subs->size; i++) {
+        if (ctx->entry) {
+            cache_entry_add(ctx, subs->members[i], chan_len);
+        }
+        ctx->proc(chan, chan_len, subs->members[i], ctx->privdata);
+    }
+}
+
+static void snap_match_patterns(shard_snap *snap, const char *topic,
+        size_t topic_len, match_ctx *ctx)
+{
+    if (snap && seg_trie_size(&snap->patterns)) {
+        ctx->kind = SUB_KIND_PATTERN;
+        seg_trie_match(&snap->patterns, topic, topic_len, match_sub, ctx);
+    }
+}
+
+/* The entry of the cache of reader holding the result of topic as of gen,
+ * or NULL on a miss. In the latter case *slot is set to the entry the
+ * result is to be recorded in, NULL if it is not to be cached. */
+static cache_entry *cache_lookup(int reader, const char *topic,
+        size_t topic_len, unsigned long long gen, cache_entry **slot)
+{
+    match_cache *cache = &caches[reader];
+    cache_entry *e;
+
+    *slot = NULL;
+    if (!cache->entries) {
+        return NULL;
+    }
+    /* longer topics are never cached, nor hashed for nothing */
+    if (topic_len > MATCH_CACHE_MAX_TOPIC) {
+        __atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    e = &cache->entries[hmap_hash(topic, topic_len) & cache->mask];
+    if (e->gen == gen && e->topic_len == topic_len &&
+            memcmp(e->topic, topic, topic_len) == 0) {
+        __atomic_store_n(&cache->hits, cache->hits + 1, __ATOMIC_RELAXED);
+        return e;
+    }
+    __atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+    if (cache_entry_reset(e, topic, topic_len, gen) == SUBINDEX_OK) {
+        *slot = e;
+    }
+    return NULL;
+}
+
+/* Call proc for every subscriber matched by topic: first those of the exact
+ * channel equal to it, then those of the channels which are a prefix of
+ * topic, from the shortest to the longest, then those of the patterns.
+ * reader is the epoch slot of the calling thread, in [0, nreaders). */
+void sub_index_match(int reader, const char *topic, size_t topic_len,
+        sub_index_proc *proc, void *privdata)
+{
+    match_ctx ctx = {SUB_KIND_PREFIX, proc, privdata, NULL};
+    shard_snap *snap;
+    cache_entry *e;
+    cache_rcpt *r;
+    unsigned long long gen;
+    uint64_t hash = 0;
+    void *subs;
+    int i;
+
+    if (topic_len == 0) {
+        return;
+    }
+
+    epoch_enter(reader);
+    /* read before the snapshots, a result is cached as of the generation
+     * it may be older than */
+    gen = __atomic_load_n(&generation, __ATOMIC_SEQ_CST);
+    if ((e = cache_lookup(reader, topic, topic_len, gen, &ctx.entry))
+            != NULL) {
+        for (i = 0, r = e->rcpts; i < e->count; i++, r++) {
+            proc(r->chan_len ? topic : NULL, r->chan_len, r->sub, privdata);
+        }
+        epoch_exit(reader);
+        return;
+    }
+
+    /* no exact channel is longer than a bulk string, the topic is hashed
+     * once for its shard and its lookup */
+    if (topic_len <= MAX_BULK_LEN &&
+            __atomic_load_n(&exact_channels, __ATOMIC_SEQ_CST)) {
+        hash = hmap_hash(topic, topic_len);
+        snap = __atomic_load_n(&exact_shard(hash)->snap, __ATOMIC_SEQ_CST);
+    } else {
+        snap = NULL;
+    }
+    if (snap && snap->exact &&
+            (subs = hmap_get_hashed(snap->exact, hash, topic, topic_len))
+            != NULL) {
+        ctx.kind = SUB_KIND_EXACT;
+        match_sub(topic, topic_len, subs, &ctx);
+        ctx.kind = SUB_KIND_PREFIX;
+    }
+    snap = __atomic_load_n(&shards[(unsigned char) topic[0]].snap,
+            __ATOMIC_SEQ_CST);
+    if (snap && trie_size(&snap->trie)) {
+        trie_prefixes(&snap->trie, topic, topic_len, match_sub, &ctx);
+    }
+    snap_match_patterns(snap, topic, topic_len, &ctx);
+    snap = __atomic_load_n(&shards[WILD_SHARD].snap, __ATOMIC_SEQ_CST);
+    snap_match_patterns(snap, topic, topic_len, &ctx);
+    epoch_exit(reader);
+}
+
+/* Sum of the cache hits and misses of all readers */
+void sub_index_cache_stats(long long *hits, long long *misses)
+{
+    int i;
+
+    *hits = *misses = 0;
+    for (i = 0; i < ncaches; i++) {
+        *hits += __atomic_load_n(&caches[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&caches[i].misses, __ATOMIC_RELAXED);
+    }
+}
+
+#ifdef SUBINDEX_TEST_MAIN
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Writers keep subscribing and unsubscribing subscribers to random channels
+ * while readers match random topics. A subscriber is poisoned and freed
+ * once it is unsubscribed from all its channels and its epoch has passed,
+ * readers check they never see one. */
+
+#define TEST_READERS    4
+#define TEST_WRITERS    2
+#define TEST_SUBS       64
+#define TEST_ROUNDS     5000
+/* channels of 1 to 3 bytes out of 'a', 'b' and 'c', then patterns, then
+ * exact channels */
+#define TEST_PREFIXES   (3 + 9 + 27)
+#define TEST_PATTERNS   6
+#define TEST_EXACTS     4
+#define TEST_CHANS      (TEST_PREFIXES + TEST_PATTERNS + TEST_EXACTS)
+#define TEST_ALIVE      0x5ab5c71e
+#define TEST_DEAD       0xdeadbeef
+
+typedef struct test_sub {
+    unsigned int magic;
+    /* bit i is set while subscribed to channel i */
+    unsigned long long chans;
+} test_sub;
+
+typedef struct test_match {
+    const char *topic;
+    size_t topic_len;
+    long long found;
+} test_match;
+
+static const char *test_patterns[TEST_PATTERNS] = {
+    "*", ">", "a.*", "a.>", "*.z", "ab.z"
+};
+
+static const char *test_exacts[TEST_EXACTS] = {
+    "a.z", "abz", "cc.z", "b"
+};
+
+static int test_stop;
+
+static void test_sub_free(void *ptr)
+{
+    test_sub *sub = (test_sub *) ptr;
+    sub->magic = TEST_DEAD;
+    free(sub);
+}
+
+/* The n-th test channel and its kind, few short channels over a few first
+ * bytes so that they collide */
+static int test_chan(int n, char *buf, size_t *len)
+{
+    size_t i;
+
+    if (n >= TEST_PREFIXES + TEST_PATTERNS) {
+        *len = strlen(test_exacts[n - TEST_PREFIXES - TEST_PATTERNS]);
+        memcpy(buf, test_exacts[n - TEST_PREFIXES - TEST_PATTERNS], *len);
+        return SUB_KIND_EXACT;
+    }
+    if (n >= TEST_PREFIXES) {
+        *len = strlen(test_patterns[n - TEST_PREFIXES]);
+        memcpy(buf, test_patterns[n - TEST_PREFIXES], *len);
+        return SUB_KIND_PATTERN;
+    }
+    if (n < 3) {
+        *len = 1;
+    } else if (n < 12) {
+        *len = 2;
+        n -= 3;
+    } else {
+        *len = 3;
+        n -= 12;
+    }
+    for (i = 0; i < *len; i++) {
+        buf[*len - 1 - i] = 'a' + n % 3;
+        n /= 3;
+    }
+    return SUB_KIND_PREFIX;
+}
+
+static void test_proc(const char *chan, size_t chan_len, void *ptr,
+        void *privdata)
+{
+    test_match *m = (test_match *) privdata;
+    test_sub *sub = (test_sub *) ptr;
+
+    if (chan) {
+        assert(chan == m->topic && chan_len > 0 && chan_len <= m->topic_len);
+    } else {
+        assert(chan_len == 0);
+    }
+    assert(sub->magic == TEST_ALIVE);
+    m->found++;
+}
+
+static void *test_reader(void *args)
+{
+    int slot = (int) (long) args;
+    unsigned int seed = slot;
+    char topic[8];
+    size_t len;
+    test_match m;
+    long long found = 0;
+
+    while (!__atomic_load_n(&test_stop, __ATOMIC_RELAXED)) {
+        test_chan(rand_r(&seed) % TEST_PREFIXES, topic, &len);
+        if (rand_r(&seed) % 2) {
+            topic[len++] = '.';
+        }
+        topic[len++] = 'z';
+        m.topic = topic;
+        m.topic_len = len;
+        m.found = 0;
+        sub_index_match(slot, topic, len, test_proc, &m);
+        found += m.found;
+    }
+    printf("reader %d: %lld matches\n", slot, found);
+    return NULL;
+}
+
+static test_sub *test_sub_create()
+{
+    test_sub *sub = (test_sub *) calloc(1, sizeof(test_sub));
+    sub->magic = TEST_ALIVE;
+    return sub;
+}
+
+static void test_unsubscribe_all(test_sub *sub)
+{
+    char chan[8];
+    size_t len;
+    int i, kind;
+
+    for (i = 0; i < TEST_CHANS; i++) {
+        if (sub->chans & (1ULL << i)) {
+            kind = test_chan(i, chan, &len);
+            assert(sub_index_del(kind, chan, len, sub) == SUBINDEX_OK);
+        }
+    }
+    sub->chans = 0;
+    sub_index_commit();
+}
+
+static void *test_writer(void *args)
+{
+    int n = (int) (long) args;
+    unsigned int seed = 1000 + n;
+    test_sub *subs[TEST_SUBS];
+    char chan[8];
+    size_t len;
+    int i, k, ch, op, kind;
+
+    for (i = 0; i < TEST_SUBS; i++) {
+        subs[i] = test_sub_create();
+    }
+    for (i = 0; i < TEST_ROUNDS; i++) {
+        k = rand_r(&seed) % TEST_SUBS;
+        ch = rand_r(&seed) % TEST_CHANS;
+        kind = test_chan(ch, chan, &len);
+        op = rand_r(&seed) % 8;
+        if (rand_r(&seed) % 4 == 0) {
+            /* batch a few changes before they are seen */
+            sub_index_commit();
+        }
+        if (op < 5) {
+            assert(sub_index_add(kind, chan, len, subs[k]) == SUBINDEX_OK);
+            subs[k]->chans |= 1ULL << ch;
+        } else if (op < 7) {
+            assert(sub_index_del(kind, chan, len, subs[k]) ==
+                    ((subs[k]->chans & (1ULL << ch)) ? SUBINDEX_OK :
+                     SUBINDEX_ERR));
+            subs[k]->chans &= ~(1ULL << ch);
+        } else {
+            test_unsubscribe_all(subs[k]);
+            /* readers may still hold it until the epoch has passed */
+            epoch_retire(subs[k], test_sub_free);
+            subs[k] = test_sub_create();
+        }
+    }
+    for (i = 0; i < TEST_SUBS; i++) {
+        test_unsubscribe_all(subs[i]);
+        epoch_retire(subs[i], test_sub_free);
+    }
+    epoch_reclaim();
+    return NULL;
+}
+
+static double test_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Subscribing next to a large index must cost about as much as next to a
+ * small one, a change copies the path to its channel and its set but not
+ * the rest of the shard. Every channel shares its first byte. */
+
+#define RATE_SMALL      100
+#define RATE_LARGE      100000
+#define RATE_ROUNDS     2000
+/* how much slower the subscribes next to the large index may be */
+#define RATE_SLOWDOWN   20
+
+static size_t rate_chan(int kind, size_t n, char *buf)
+{
+    return sprintf(buf, kind == SUB_KIND_PATTERN ? "md.*.%zu" : "md.%zu", n);
+}
+
+/* Seconds taken by RATE_ROUNDS batches, each one a subscribe to an old and
+ * to a new channel of every kind, with nchans channels of each kind
+ * subscribed to beforehand */
+static double test_subscribe_time(size_t nchans)
+{
+    test_sub *old_sub = test_sub_create(), *sub = test_sub_create();
+    char chan[32];
+    size_t len, i;
+    double start, elapsed;
+    int kind;
+
+    for (kind = SUB_KIND_PREFIX; kind <= SUB_KIND_EXACT; kind++) {
+        for (i = 0; i < nchans; i++) {
+            len = rate_chan(kind, i, chan);
+            assert(sub_index_add(kind, chan, len, old_sub) == SUBINDEX_OK);
+        }
+    }
+    sub_index_commit();
+
+    start = test_now();
+    for (i = 0; i < RATE_ROUNDS; i++) {
+        for (kind = SUB_KIND_PREFIX; kind <= SUB_KIND_EXACT; kind++) {
+            len = rate_chan(kind, i % nchans, chan);
+            assert(sub_index_add(kind, chan, len, sub) == SUBINDEX_OK);
+            len = rate_chan(kind, nchans + i, chan);
+            assert(sub_index_add(kind, chan, len, sub) == SUBINDEX_OK);
+        }
+        sub_index_commit();
+    }
+    elapsed = test_now() - start;
+    printf("%zu channels: %.0f subscribes/s\n", 3 * nchans,
+            RATE_ROUNDS * 6 / elapsed);
+
+    for (kind = SUB_KIND_PREFIX; kind <= SUB_KIND_EXACT; kind++) {
+        for (i = 0; i < nchans + RATE_ROUNDS; i++) {
+            len = rate_chan(kind, i, chan);
+            if (i < nchans) {
+                assert(sub_index_del(kind, chan, len, old_sub) ==
+                        SUBINDEX_OK);
+            }
+            /* not subscribed to every old channel */
+            sub_index_del(kind, chan, len, sub);
+        }
+    }
+    sub_index_commit();
+    free(old_sub);
+    free(sub);
+    return elapsed;
+}
+
+static void test_expect(const char *topic, long long found)
+{
+    test_match m;
+
+    m.topic = topic;
+    m.topic_len = strlen(topic);
+    m.found = 0;
+    sub_index_match(0, topic, m.topic_len, test_proc, &m);
+    assert(m.found == found);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t readers[TEST_READERS], writers[TEST_WRITERS];
+    test_sub sub;
+    long long hits, misses;
+    long i;
+    (void) argc;
+    (void) argv;
+
+    /* a small cache, so that topics collide */
+    assert(sub_index_init(TEST_READERS, 60) == SUBINDEX_OK);
+
+    /* single threaded sanity checks */
+    sub.magic = TEST_ALIVE;
+    assert(sub_index_add(SUB_KIND_PREFIX, "ab", 2, &sub) == SUBINDEX_OK);
+    assert(sub_index_add(SUB_KIND_PREFIX, "abc", 3, &sub) == SUBINDEX_OK);
+    assert(sub_index_add(SUB_KIND_PREFIX, "abc", 3, &sub) == SUBINDEX_OK);
+    assert(sub_index_add(SUB_KIND_PATTERN, "*.d", 3, &sub) == SUBINDEX_OK);
+    assert(sub_index_add(SUB_KIND_PATTERN, "a.>.b", 5, &sub) == SUBINDEX_ERR);
+    assert(sub_index_add(SUB_KIND_EXACT, "abc.d", 5, &sub) == SUBINDEX_OK);
+    assert(sub_index_add(SUB_KIND_EXACT, "b", 1, &sub) == SUBINDEX_OK);
+    test_expect("abcd", 0);
+    sub_index_commit();
+    test_expect("abcd", 2);
+    test_expect("abcd", 2);
+    sub_index_cache_stats(&hits, &misses);
+    assert(hits == 1 && misses == 2);
+    test_expect("abc.d", 4);
+    test_expect("abc.de", 2);
+    test_expect("b", 1);
+    test_expect("bb", 0);
+    assert(sub_index_del(SUB_KIND_PREFIX, "b", 1, &sub) == SUBINDEX_ERR);
+    assert(sub_index_del(SUB_KIND_EXACT, "b", 1, &sub) == SUBINDEX_OK);
+    assert(sub_index_del(SUB_KIND_EXACT, "abc.d", 5, &sub) == SUBINDEX_OK);
+    assert(sub_index_del(SUB_KIND_PREFIX, "ab", 2, &sub) == SUBINDEX_OK);
+    assert(sub_index_del(SUB_KIND_PREFIX, "ab", 2, &sub) == SUBINDEX_ERR);
+    assert(sub_index_del(SUB_KIND_PREFIX, "a", 1, &sub) == SUBINDEX_ERR);
+    assert(sub_index_del(SUB_KIND_PREFIX, "*.d", 3, &sub) == SUBINDEX_ERR);
+    sub_index_commit();
+    test_expect("abc.d", 2);
+    assert(sub_index_del(SUB_KIND_PREFIX, "abc", 3, &sub) == SUBINDEX_OK);
+    assert(sub_index_del(SUB_KIND_PATTERN, "*.d", 3, &sub) == SUBINDEX_OK);
+    sub_index_commit();
+    assert(shards['a'].snap == NULL && shards[WILD_SHARD].snap == NULL);
+    test_expect("abc.d", 0);
+
+    assert(test_subscribe_time(RATE_LARGE) <
+            RATE_SLOWDOWN * test_subscribe_time(RATE_SMALL));
+    for (i = 0; i < SUB_INDEX_SHARDS; i++) {
+        assert(shards[i].snap == NULL);
+    }
+
+    zmalloc_enable_thread_safeness();
+    for (i = 0; i < TEST_READERS; i++) {
+        pthread_create(&readers[i], NULL, test_reader, (void *) i);
+    }
+    for (i = 0; i < TEST_WRITERS; i++) {
+        pthread_create(&writers[i], NULL, test_writer, (void *) i);
+    }
+    for (i = 0; i < TEST_WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    __atomic_store_n(&test_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < TEST_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    sub_index_cache_stats(&hits, &misses);
+    printf("cache: %lld hits, %lld misses\n", hits, misses);
+
+    /* every subscriber was removed, so every shard is empty */
+    for (i = 0; i < SUB_INDEX_SHARDS; i++) {
+        assert(shards[i].snap == NULL && shards[i].draft == NULL);
+    }
+    sub_index_free();
+
+    printf("sub_index_test ok\n");
+
+    return 0;
+}
+#endif
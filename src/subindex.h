@@ -0,0 +1,60 @@
+#ifndef __SUBINDEX_H
+#define __SUBINDEX_H
+
+#include <stddef.h>
+
+#define SUBINDEX_OK     0
+#define SUBINDEX_ERR    -1
+
+/* subscription kinds */
+#define SUB_KIND_PREFIX     0   /* matches the topics it is a prefix of */
+#define SUB_KIND_PATTERN    1   /* segment pattern, see seg_trie */
+#define SUB_KIND_EXACT      2   /* matches the topic equal to it */
+
+/* The subscriptions of all clients, shared by the I/O threads.
+ *
+ * Channels are sharded by their first byte, which is also the first byte of
+ * every topic they match, so a publish only looks at one shard. Each shard
+ * is an immutable snapshot: a trie of its channels whose values are the
+ * sets of subscribers, so a single walk over a topic yields every set it is
+ * delivered to. Writers of a shard serialize on its lock and build a draft
+ * of the next snapshot, which sub_index_commit() swaps in. The draft
+ * shares the nodes and sets of the snapshot, only the path to a changed
+ * channel and its set are copied, see trie_txn, so a change costs the same
+ * whatever the size of the shard. Readers never lock, they walk the
+ * snapshot current when they started and what the drafts replaced is freed
+ * once no reader can still see it.
+ *
+ * Exact channels are kept in hash tables sharded by the hash of the whole
+ * channel, so a topic is matched against them with a single probe and a
+ * change copies the table of a small shard. The trie is not walked at all
+ * when the shard has no prefix channel.
+ *
+ * Patterns are kept in a segment trie next to the channels, in the shard of
+ * their first byte, but for those starting with a wildcard segment which
+ * share a shard looked at by every publish.
+ *
+ * Every reader keeps the subscribers its recent topics matched in a cache
+ * of cache_size topics, so a hot topic costs a hash lookup and a walk over
+ * an array. Any commit makes the cached results stale.
+ *
+ * Subscribers are opaque pointers, kept in flat sets, see subset.
+ * */
+
+/* Called for every subscriber of every subscription matching a topic. A
+ * channel is the first chan_len bytes of the topic, chan is NULL and
+ * chan_len 0 for a pattern. A subscriber is reported once per subscription
+ * matching the topic. */
+typedef void sub_index_proc(const char *chan, size_t chan_len, void *sub,
+        void *privdata);
+
+int sub_index_init(int nreaders, size_t cache_size);
+void sub_index_free();
+int sub_index_add(int kind, const char *chan, size_t chan_len, void *sub);
+int sub_index_del(int kind, const char *chan, size_t chan_len, void *sub);
+void sub_index_commit();
+void sub_index_match(int reader, const char *topic, size_t topic_len,
+        sub_index_proc *proc, void *privdata);
+void sub_index_cache_stats(long long *hits, long long *misses);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
@@ -62,8 +63,10 @@ void srv_log(int level, const char *fmt, ...)
 
     char msg[SIZE1024];
     struct timeval tv;
+    struct tm tm;
     gettimeofday(&tv, NULL);
-    size_t offset = strftime(msg, sizeof(msg), "%F %T", localtime(&tv.tv_sec));
+    size_t offset = strftime(msg, sizeof(msg), "%F %T",
+            localtime_r(&tv.tv_sec, &tm));
     offset += snprintf(msg + offset, sizeof(msg), ".%03.f ", (float)tv.tv_usec/1000);
     offset += snprintf(msg + offset, sizeof(msg) - offset, "[%s] ", level_str);
 
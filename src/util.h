@@ -10,6 +10,11 @@
 #define LOG_WARN 2
 #define LOG_ERROR 3
 
+/* counters shared by the I/O threads, both return the updated value */
+#define atomic_incr(var, n) __atomic_add_fetch((var), (n), __ATOMIC_RELAXED)
+#define atomic_decr(var, n) __atomic_sub_fetch((var), (n), __ATOMIC_ACQ_REL)
+#define atomic_get(var) __atomic_load_n((var), __ATOMIC_RELAXED)
+
 #define LOG_DEBUG_STR "DEBUG"
 #define LOG_INFO_STR "INFO"
 #define LOG_WARN_STR "WARN"
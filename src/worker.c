@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <event2/event.h>
+
+#include "worker.h"
+#include "broker.h"
+#include "net.h"
+#include "event.h"
+#include "util.h"
+#include "subcli.h"
+#include "epoch.h"
+#include "zmalloc.h"
+
+static void notify_handler(evutil_socket_t fd, short event, void *args);
+static void worker_cron(evutil_socket_t fd, short event, void *args);
+static void spill_retry(evutil_socket_t fd, short event, void *args);
+static void spill_release(delivery_queue *q);
+
+static int open_listener(worker *w, int port, char *bindaddr, int backlog)
+{
+    int fd;
+
+    /* with several workers every one of them listens on its own socket and
+     * the kernel spreads the connections among them */
+    if (server.io_threads > 1) {
+        fd = net_tcp_server_reuseport(w->neterr, port, bindaddr, backlog);
+    } else {
+        fd = net_tcp_server(w->neterr, port, bindaddr, backlog);
+    }
+    if (fd == NET_ERR) {
+        srv_log(LOG_ERROR, "opening socket: %s", w->neterr);
+        return NET_ERR;
+    }
+    net_tcp_set_nonblock(NULL, fd);
+    return fd;
+}
+
+static int worker_init(worker *w, int id)
+{
+    w->id = id;
+    w->pub_srv_fd = -1;
+    w->sub_srv_fd = -1;
+    w->pub_ev = NULL;
+    w->sub_ev = NULL;
+    w->clients_to_close = lkd_list_create();
+    w->clients_to_free = lkd_list_create();
+    w->clients_pending_write = NULL;
+    w->slots = NULL;
+    w->nslots = 0;
+    w->free_slot = 0;
+    w->rings = (ring **) zcalloc(server.io_threads * sizeof(ring *));
+    w->wakeup = (unsigned char *) zcalloc(server.io_threads);
+    w->spill = (delivery_queue *) zcalloc(server.io_threads *
+            sizeof(delivery_queue));
+    w->notified = 0;
+    if (!w->rings || !w->wakeup || !w->spill) {
+        return BROKER_ERR;
+    }
+
+    w->evloop = event_base_new();
+    if (!w->evloop) {
+        srv_log(LOG_ERROR, "failed to initialize event loop");
+        return BROKER_ERR;
+    }
+
+    w->close_ev = event_new(w->evloop, -1, 0, free_clients_to_close, w);
+    w->flush_ev = event_new(w->evloop, -1, 0, flush_clients_pending_write, w);
+
+    struct timeval tv = {0, WORKER_CRON_MS * 1000};
+    w->cron_ev = event_new(w->evloop, -1, EV_PERSIST, worker_cron, w);
+    event_add(w->cron_ev, &tv);
+    w->spill_ev = evtimer_new(w->evloop, spill_retry, w);
+
+    w->notify_fd = eventfd(0, EFD_NONBLOCK);
+    if (w->notify_fd == -1) {
+        srv_log(LOG_ERROR, "failed to create eventfd: %s", strerror(errno));
+        return BROKER_ERR;
+    }
+    w->notify_ev = event_new(w->evloop, w->notify_fd, EV_READ|EV_PERSIST,
+            notify_handler, w);
+    event_add(w->notify_ev, NULL);
+
+    w->pub_srv_fd = open_listener(w, server.pub_port, server.pub_ip,
+            server.pub_backlog);
+    if (w->pub_srv_fd == NET_ERR) {
+        return BROKER_ERR;
+    }
+    w->pub_ev = event_new(w->evloop, w->pub_srv_fd, EV_READ|EV_PERSIST,
+            accept_pub_handler, w);
+    event_add(w->pub_ev, NULL);
+
+    w->sub_srv_fd = open_listener(w, server.sub_port, server.sub_ip,
+            server.sub_backlog);
+    if (w->sub_srv_fd == NET_ERR) {
+        return BROKER_ERR;
+    }
+    w->sub_ev = event_new(w->evloop, w->sub_srv_fd, EV_READ|EV_PERSIST,
+            accept_sub_handler, w);
+    event_add(w->sub_ev, NULL);
+
+    return BROKER_OK;
+}
+
+int workers_init()
+{
+    int i;
+
+    server.workers = (worker *) zcalloc(server.io_threads * sizeof(worker));
+    if (!server.workers) {
+        return BROKER_ERR;
+    }
+    for (i = 0; i < server.io_threads; i++) {
+        if (worker_init(server.workers + i, i) != BROKER_OK) {
+            return BROKER_ERR;
+        }
+    }
+    return BROKER_OK;
+}
+
+static void *worker_main(void *args)
+{
+    worker *w = (worker *) args;
+    event_base_dispatch(w->evloop);
+    return NULL;
+}
+
+/* Start the I/O threads and run the first worker in the calling thread */
+void workers_run()
+{
+    int i;
+
+    for (i = 1; i < server.io_threads; i++) {
+        if (pthread_create(&server.workers[i].tid, NULL, worker_main,
+                    server.workers + i) != 0) {
+            srv_log(LOG_ERROR, "failed to create io thread %d", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    server.workers[0].tid = pthread_self();
+    worker_main(server.workers);
+    for (i = 1; i < server.io_threads; i++) {
+        pthread_join(server.workers[i].tid, NULL);
+    }
+}
+
+void workers_free()
+{
+    int i, j;
+    worker *w;
+
+    if (!server.workers) {
+        return;
+    }
+    for (i = 0; i < server.io_threads; i++) {
+        w = server.workers + i;
+        if (w->pub_ev != NULL) event_free(w->pub_ev);
+        if (w->sub_ev != NULL) event_free(w->sub_ev);
+        if (w->close_ev != NULL) event_free(w->close_ev);
+        if (w->flush_ev != NULL) event_free(w->flush_ev);
+        if (w->cron_ev != NULL) event_free(w->cron_ev);
+        if (w->notify_ev != NULL) event_free(w->notify_ev);
+        if (w->spill_ev != NULL) event_free(w->spill_ev);
+        if (w->evloop != NULL) event_base_free(w->evloop);
+        lkd_list_release(&w->clients_to_close);
+        lkd_list_release(&w->clients_to_free);
+        zfree(w->slots);
+        for (j = 0; j < server.io_threads; j++) {
+            if (w->rings[j]) ring_free(w->rings[j]);
+            spill_release(&w->spill[j]);
+        }
+        zfree(w->rings);
+        zfree(w->wakeup);
+        zfree(w->spill);
+    }
+    zfree(server.workers);
+    server.workers = NULL;
+}
+
+/* Give c a slot of w and the handle to it. Returns BROKER_ERR on out of
+ * memory. */
+int worker_add_client(worker *w, struct sub_client *c)
+{
+    client_slot *slots;
+    uint32_t i, n;
+
+    if (w->free_slot == w->nslots) {
+        n = w->nslots ? w->nslots * 2 : SIZE64;
+        if ((slots = zrealloc(w->slots, n * sizeof(client_slot))) == NULL) {
+            return BROKER_ERR;
+        }
+        for (i = w->nslots; i < n; i++) {
+            slots[i].c = NULL;
+            slots[i].gen = 1;
+            slots[i].next_free = i + 1;
+        }
+        w->slots = slots;
+        w->nslots = n;
+    }
+    i = w->free_slot;
+    w->free_slot = w->slots[i].next_free;
+    w->slots[i].c = c;
+    c->handle = HANDLE_MAKE(i, w->slots[i].gen);
+    return BROKER_OK;
+}
+
+/* Free the slot of c, its handle does not resolve any more */
+void worker_remove_client(worker *w, struct sub_client *c)
+{
+    client_slot *slot;
+
+    if (!worker_get_client(w, c->handle)) {
+        return;
+    }
+    slot = &w->slots[HANDLE_SLOT(c->handle)];
+    slot->c = NULL;
+    slot->gen = slot->gen == UINT32_MAX ? 1 : slot->gen + 1;
+    slot->next_free = w->free_slot;
+    w->free_slot = HANDLE_SLOT(c->handle);
+}
+
+/* The client of w with handle h, or NULL if it was released */
+struct sub_client *worker_get_client(worker *w, client_handle h)
+{
+    uint32_t i = HANDLE_SLOT(h);
+
+    if (i >= w->nslots || w->slots[i].gen != HANDLE_GEN(h)) {
+        return NULL;
+    }
+    return w->slots[i].c;
+}
+
+static void wakeup_worker(worker *w)
+{
+    uint64_t one = 1;
+
+    /* a single wakeup stays pending until the worker processes its rings */
+    if (__atomic_exchange_n(&w->notified, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    if (write(w->notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        srv_log(LOG_ERROR, "failed to notify worker %d: %s", w->id,
+                strerror(errno));
+    }
+}
+
+/* Append d to q */
+static int spill_push(delivery_queue *q, delivery *d)
+{
+    delivery *items;
+    size_t cap, i;
+
+    if (q->count == q->cap) {
+        cap = q->cap ? q->cap * 2 : WORKER_RING_LEN;
+        if ((items = zmalloc(cap * sizeof(delivery))) == NULL) {
+            return BROKER_ERR;
+        }
+        for (i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->cap];
+        }
+        zfree(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->items[(q->head + q->count) % q->cap] = *d;
+    q->count++;
+    return BROKER_OK;
+}
+
+/* Move what fits of q to r, oldest first */
+static void spill_drain(delivery_queue *q, ring *r)
+{
+    while (q->count && ring_push(r, &q->items[q->head]) == RING_OK) {
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+}
+
+static void spill_release(delivery_queue *q)
+{
+    for (; q->count; q->count--, q->head = (q->head + 1) % q->cap) {
+        msg_decr_ref(q->items[q->head].msg);
+    }
+    zfree(q->items);
+    q->items = NULL;
+    q->cap = 0;
+}
+
+/* Spill d to c in q. The spilled deliveries to a subscriber count against
+ * the hard output limit of its class: past it they are dropped, the first
+ * one being spilled as a notice so that the owner of c applies its slow
+ * consumer policy. */
+static void spill_delivery(delivery_queue *q, struct sub_client *c,
+        delivery *d)
+{
+    size_t hard = server.obuf_limits[SUBCLI_CLASS_PUBSUB].hard_limit;
+    size_t size = d->msg->len + sizeof(delivery);
+
+    if (hard && atomic_get(&c->spilled_bytes) + size > hard) {
+        /* a single notice is pending until the owner handles it, the
+         * deliveries lost meanwhile are only counted */
+        if (atomic_incr(&c->spill_lost, 1) > 1) {
+            msg_decr_ref(d->msg);
+            return;
+        }
+        d->flags = DELIVERY_LOST;
+    } else {
+        d->flags = DELIVERY_SPILLED;
+    }
+
+    if (spill_push(q, d) != BROKER_OK) {
+        if (d->flags & DELIVERY_LOST) {
+            atomic_decr(&c->spill_lost, 1);
+        }
+        msg_decr_ref(d->msg);
+        atomic_incr(&server.stat_slow_dropped, 1);
+        return;
+    }
+    /* before the owner can see it, the spill is drained later on */
+    if (d->flags & DELIVERY_SPILLED) {
+        atomic_incr(&c->spilled_bytes, size);
+    }
+}
+
+/* Hand msg over to worker to, which owns c. Called by worker from while it
+ * matches a publish, the owner is only woken up by worker_wakeup_pending()
+ * once the whole batch is handed over.
+ *
+ * This never waits for the owner: with its ring full, the delivery is
+ * spilled and moved to the ring later, after every delivery spilled before
+ * it so the order is kept. */
+void worker_deliver(worker *from, worker *to, struct sub_client *c,
+        message *msg, size_t chan_len)
+{
+    ring *r = to->rings[from->id];
+    delivery_queue *q;
+    delivery d;
+
+    if (!r) {
+        r = ring_create(WORKER_RING_LEN, sizeof(delivery));
+        if (!r) {
+            srv_log(LOG_ERROR, "failed to create ring to worker %d", to->id);
+            return;
+        }
+        __atomic_store_n(&to->rings[from->id], r, __ATOMIC_RELEASE);
+    }
+
+    msg_incr_ref(msg);
+    d.msg = msg;
+    d.c = c->handle;
+    d.chan_len = chan_len;
+    d.flags = 0;
+    q = &from->spill[to->id];
+    if (q->count || ring_push(r, &d) != RING_OK) {
+        spill_delivery(q, c, &d);
+    }
+    from->wakeup[to->id] = 1;
+}
+
+/* Wake up the workers deliveries were handed over to since the last call,
+ * once per batch of publishes. The spilled deliveries are moved to the
+ * rings first, and retried every WORKER_SPILL_RETRY_MS while some are
+ * left. */
+void worker_wakeup_pending(worker *w)
+{
+    struct timeval tv = {0, WORKER_SPILL_RETRY_MS * 1000};
+    int i, spilled = 0;
+
+    for (i = 0; i < server.io_threads; i++) {
+        if (w->spill[i].count) {
+            spill_drain(&w->spill[i], server.workers[i].rings[w->id]);
+            spilled |= w->spill[i].count != 0;
+        }
+        if (w->wakeup[i]) {
+            w->wakeup[i] = 0;
+            wakeup_worker(server.workers + i);
+        }
+    }
+    if (spilled && !evtimer_pending(w->spill_ev, NULL)) {
+        evtimer_add(w->spill_ev, &tv);
+    }
+}
+
+static void spill_retry(evutil_socket_t fd, short event, void *args)
+{
+    worker *w = (worker *) args;
+    int i;
+    (void) fd;
+    (void) event;
+
+    for (i = 0; i < server.io_threads; i++) {
+        w->wakeup[i] |= w->spill[i].count != 0;
+    }
+    worker_wakeup_pending(w);
+}
+
+/* Queue the deliveries from other workers to their subscribers */
+void worker_process_inbox(worker *w)
+{
+    ring *r;
+    delivery d;
+    struct sub_client *c;
+    const char *chan;
+    size_t topic_len;
+    int i;
+
+    for (i = 0; i < server.io_threads; i++) {
+        r = __atomic_load_n(&w->rings[i], __ATOMIC_ACQUIRE);
+        if (!r) {
+            continue;
+        }
+        while (ring_pop(r, &d) == RING_OK) {
+            if ((c = worker_get_client(w, d.c)) != NULL) {
+                if (d.flags & DELIVERY_SPILLED) {
+                    atomic_decr(&c->spilled_bytes,
+                            d.msg->len + sizeof(delivery));
+                }
+                chan = d.chan_len ? msg_topic(d.msg, &topic_len) : NULL;
+                if (d.flags & DELIVERY_LOST) {
+                    handle_lost_deliveries(c, d.msg, chan, d.chan_len);
+                } else {
+                    add_reply_msg(c, d.msg, chan, d.chan_len);
+                }
+            }
+            msg_decr_ref(d.msg);
+        }
+    }
+}
+
+static void notify_handler(evutil_socket_t fd, short event, void *args)
+{
+    worker *w = (worker *) args;
+    uint64_t val;
+    (void) event;
+
+    if (read(fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        srv_log(LOG_ERROR, "failed to read notification of worker %d: %s",
+                w->id, strerror(errno));
+    }
+    /* deliveries pushed after this point need a new wakeup */
+    __atomic_store_n(&w->notified, 0, __ATOMIC_SEQ_CST);
+    worker_process_inbox(w);
+}
+
+static void worker_cron(evutil_socket_t fd, short event, void *args)
+{
+    worker *w = (worker *) args;
+    (void) fd;
+    (void) event;
+
+    free_unsubscribed_clients(w);
+    epoch_reclaim();
+}
@@ -0,0 +1,130 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <event2/event.h>
+
+#include "list.h"
+#include "ring.h"
+#include "hmap.h"
+#include "message.h"
+#include "constant.h"
+
+struct sub_client;
+
+/* A sub client as known by its worker: the generation of its slot in the
+ * upper 32 bits, the slot in the lower ones. The generation changes when
+ * the client is released, so a handle never refers to a later client
+ * reusing the slot. 0 is never a valid handle. */
+typedef uint64_t client_handle;
+
+#define HANDLE_SLOT(h)      ((uint32_t) (h))
+#define HANDLE_GEN(h)       ((uint32_t) ((h) >> 32))
+#define HANDLE_MAKE(s, g)   (((client_handle) (g) << 32) | (s))
+
+typedef struct client_slot {
+    /* NULL while the slot is free */
+    struct sub_client *c;
+    uint32_t gen;
+    /* next free slot, while the slot is free */
+    uint32_t next_free;
+} client_slot;
+
+/* A published message handed over to the worker owning the subscriber */
+typedef struct delivery {
+    message *msg;
+    /* dropped if the subscriber was released meanwhile */
+    client_handle c;
+    /* the message was matched by the channel made of its first chan_len
+     * topic bytes, or by a pattern if chan_len is 0 */
+    size_t chan_len;
+    int flags;
+} delivery;
+
+/* delivery flags */
+#define DELIVERY_SPILLED    (1<<0)  /* counted in spilled_bytes of the
+                                       subscriber */
+#define DELIVERY_LOST       (1<<1)  /* the message is not delivered, it is
+                                       the first one lost, see
+                                       handle_lost_deliveries() */
+
+/* Deliveries to a worker waiting for room in the ring to it, oldest first */
+typedef struct delivery_queue {
+    delivery *items;
+    size_t head;
+    size_t count;
+    size_t cap;
+} delivery_queue;
+
+/* An I/O thread, owning an event loop and the clients it accepted.
+ *
+ * Clients are only ever touched by the worker owning them, a publish on
+ * another worker reaches them through the delivery ring from the worker of
+ * the publisher to theirs.
+ * */
+typedef struct worker {
+    int id;
+    pthread_t tid;
+    struct event_base *evloop;
+
+    int pub_srv_fd;
+    int sub_srv_fd;
+    struct event *pub_ev;
+    struct event *sub_ev;
+
+    /* activated to free the clients in clients_to_close */
+    struct event *close_ev;
+    /* activated to flush clients_pending_write once the callbacks of the
+     * current loop iteration are done */
+    struct event *flush_ev;
+    /* sub clients which are closed asynchronously */
+    lkdList *clients_to_close;
+    /* unsubscribed sub clients waiting for the publishes of other workers
+     * which may still see them, in the order of their free_epoch */
+    lkdList *clients_to_free;
+    /* periodic housekeeping, frees clients_to_free and old subscriptions */
+    struct event *cron_ev;
+    /* sub clients which have new output to be written before the loop goes
+     * back to wait for events, linked by pending_prev/pending_next */
+    struct sub_client *clients_pending_write;
+
+    /* the sub clients of this worker by the slot of their handle, the free
+     * slots are chained from free_slot, which is nslots if there is none */
+    client_slot *slots;
+    uint32_t nslots;
+    uint32_t free_slot;
+
+    /* rings[i] carries the deliveries from worker i to this one, it is
+     * created by worker i on its first delivery */
+    ring **rings;
+    /* eventfd waking this worker up to process its rings, notified is set
+     * while a wakeup is pending so that producers write it once per batch */
+    int notify_fd;
+    int notified;
+    struct event *notify_ev;
+    /* wakeup[i] is set when this worker handed deliveries over to worker i
+     * since it last woke it up */
+    unsigned char *wakeup;
+    /* spill[i] holds the deliveries to worker i which found its ring full,
+     * they are moved to the ring once the publishes are matched */
+    delivery_queue *spill;
+    /* retries the spilled deliveries while some are left */
+    struct event *spill_ev;
+
+    /* Error buffer for net.c */
+    char neterr[NET_ERR_LEN];
+} worker;
+
+int workers_init();
+void workers_run();
+void workers_free();
+int worker_add_client(worker *w, struct sub_client *c);
+void worker_remove_client(worker *w, struct sub_client *c);
+struct sub_client *worker_get_client(worker *w, client_handle h);
+void worker_deliver(worker *from, worker *to, struct sub_client *c,
+        message *msg, size_t chan_len);
+void worker_process_inbox(worker *w);
+void worker_wakeup_pending(worker *w);
+
+#endif